@@ -0,0 +1,38 @@
+#!/bin/bash
+
+# Checks that prudaq_analyze gives the same results however many threads
+# it splits a capture across, including captures whose length isn't a
+# multiple of the thread count or of threads times the FFT size, where the
+# last thread's share is short or some threads get nothing.  Run with
+# 'make check'; it doesn't need the PRUs.
+
+ANALYZE=${ANALYZE:-./prudaq_analyze}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+status=0
+check() {
+  local samples=$1
+  shift
+  head -c $((samples * 4)) /dev/urandom > "$TMP/capture"
+  "$ANALYZE" -t 1 "$@" "$TMP/capture" > "$TMP/one" 2> /dev/null
+  for threads in 2 3 8; do
+    "$ANALYZE" -t $threads "$@" "$TMP/capture" > "$TMP/many" 2> /dev/null
+    if ! cmp -s "$TMP/one" "$TMP/many"; then
+      echo "FAIL: $samples samples with -t $threads $* differ from -t 1:"
+      diff "$TMP/one" "$TMP/many"
+      status=1
+    fi
+  done
+}
+
+check 3 -n 0
+check 15 -n 0
+check $((8 * 8192 + 5)) -n 0
+check $((8 * 1024 * 3 + 5)) -n 1024 -a
+check $((3 * 1024 - 1)) -n 1024 -a
+
+if [[ $status -eq 0 ]] ; then
+  echo "prudaq_analyze: all thread counts agree"
+fi
+exit $status
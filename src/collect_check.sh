@@ -0,0 +1,164 @@
+#!/bin/bash
+
+# Checks that prudaq_collect lines up sources that started at different
+# times and whose sample clocks drift apart, and that it fills a source's
+# overrun gap with 0xffff rather than shifting its later samples.  Each
+# generated sample encodes its source and index, so every output frame can
+# be checked against when each source actually took its samples.  Run with
+# 'make check'; it doesn't need the PRUs, but does need python3.
+
+COLLECT=${COLLECT:-./prudaq_collect}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# Nominal rate, plus for each source: start time relative to source 0 in
+# seconds, clock error in ppm, sample count, and an overrun gap (first
+# sample and count, 0 0 for none)
+cat > "$TMP/sources" << EOF
+1000000
+0       0    200000 0     0
+-0.002  50   210000 0     0
+0.001   -30  190000 20000 3000
+EOF
+
+python3 - generate "$TMP" << 'EOF' || exit 1
+import struct, sys
+tmp = sys.argv[2]
+lines = open(tmp + "/sources").read().split("\n")
+rate = float(lines[0])
+base_ns = 1700000000 * 10**9
+for s, line in enumerate(l for l in lines[1:] if l.strip()):
+    start, ppm, count, gap, gap_count = line.split()
+    start, ppm = float(start), float(ppm)
+    count, gap, gap_count = int(count), int(gap), int(gap_count)
+    period_ns = 1e9 / (rate * (1 + ppm * 1e-6))
+    data = open("%s/%d.bin" % (tmp, s), "wb")
+    markers = open("%s/%d.markers" % (tmp, s), "w")
+    markers.write("S 0 0 4 %.2f\n" % rate)
+    if gap_count:
+        markers.write("G %d %d\n" % (gap, gap_count))
+    words = []
+    for k in range(count):
+        if gap <= k < gap + gap_count:
+            continue
+        # Channel 0 has the low 10 bits of the index, channel 1 the source
+        # and the next 6 bits
+        words.append((k & 0x3ff) | (((s << 6) | ((k >> 10) & 0x3f)) << 16))
+        if k % 10000 == 0:
+            ns = base_ns + int(round(start * 1e9 + k * period_ns))
+            markers.write("T %d %d.%09d\n" % (k, ns // 10**9, ns % 10**9))
+    data.write(struct.pack("<%dI" % len(words), *words))
+EOF
+
+sources=()
+for s in 0 1 2; do
+  sources+=("$TMP/$s.bin:$TMP/$s.markers")
+done
+if ! "$COLLECT" -o "$TMP/merged" -g "$TMP/log" "${sources[@]}" 2> /dev/null
+then
+  echo "FAIL: prudaq_collect exited with an error"
+  exit 1
+fi
+
+python3 - verify "$TMP" << 'EOF'
+import struct, sys
+tmp = sys.argv[2]
+lines = open(tmp + "/sources").read().split("\n")
+rate = float(lines[0])
+sources = [l.split() for l in lines[1:] if l.strip()]
+n = len(sources)
+FILL = 0xffffffff
+
+status = 0
+def fail(message):
+    global status
+    if status < 20:
+        print("FAIL: " + message)
+    status += 1
+
+# When source s took sample k, in seconds after source 0's first sample
+def time_of(s, k):
+    return float(sources[s][0]) + k / (rate * (1 + float(sources[s][1]) * 1e-6))
+
+def sample_at(s, t):
+    return (t - float(sources[s][0])) * rate * (1 + float(sources[s][1]) * 1e-6)
+
+log = open(tmp + "/log").read().split("\n")
+offsets = {}
+# Frames left empty because a source slipped back a sample it had already
+# passed on
+slipped_back = set()
+for line in log:
+    f = line.split()
+    if f and f[0] == "P" and int(f[3]) < 0:
+        slipped_back.add((int(f[1]), int(f[2])))
+    if f and f[0] == "A":
+        offsets[int(f[1])] = int(f[2])
+        ppm = float(sources[int(f[1])][1])
+        if abs(float(f[3]) - ppm) > 0.5:
+            fail("source %s drift logged as %s ppm, not %g" % (f[1], f[3], ppm))
+for s in range(n):
+    gap, gap_count = int(sources[s][3]), int(sources[s][4])
+    if gap_count and "G %d %d %d" % (s, gap, gap_count) not in log:
+        fail("source %d's gap isn't in the log" % s)
+    if float(sources[s][1]) and not any(l.startswith("P %d " % s) for l in log):
+        fail("source %d drifted without slipping" % s)
+
+data = open(tmp + "/merged", "rb").read()
+if len(data) % (4 * n):
+    fail("output isn't a whole number of frames")
+frames = len(data) // (4 * n)
+words = struct.unpack("<%dI" % (frames * n), data[:frames * n * 4])
+start = offsets.get(0, 0)
+
+for s in range(n):
+    count, gap, gap_count = [int(x) for x in sources[s][2:5]]
+    last = -1
+    for frame in range(frames):
+        word = words[frame * n + s]
+        # Where the source should be, as a fraction, at this frame
+        expected = sample_at(s, time_of(0, start + frame))
+        if word == FILL:
+            # Only allowed where the source has no sample
+            if (0 <= expected < count - 1 and
+                not gap - 1 <= expected < gap + gap_count and
+                (s, frame) not in slipped_back):
+                fail("source %d frame %d is fill, expected sample %.2f" %
+                     (s, frame, expected))
+            continue
+        if word & ~0x03ff03ff or (word >> 22) & 0xf != s:
+            fail("source %d frame %d has another source's word %08x" %
+                 (s, frame, word))
+            continue
+        low = (word & 0x3ff) | (((word >> 16) & 0x3f) << 10)
+        k = low + int(round((expected - low) / 65536.0)) * 65536
+        if abs(k - expected) > 1:
+            fail("source %d frame %d has sample %d, expected %.2f" %
+                 (s, frame, k, expected))
+        if gap <= k < gap + gap_count:
+            fail("source %d frame %d has sample %d from inside its gap" %
+                 (s, frame, k))
+        if k <= last:
+            fail("source %d frame %d has sample %d after %d" %
+                 (s, frame, k, last))
+        last = k
+    if last < count - 2:
+        fail("source %d stopped at sample %d of %d" % (s, last, count))
+    if gap_count:
+        mid = time_of(s, gap + gap_count // 2)
+        frame = int(round((mid - time_of(0, start)) * rate))
+        if not 0 <= frame < frames or words[frame * n + s] != FILL:
+            fail("source %d's gap wasn't filled with 0xffff" % s)
+
+if words and any(w == FILL for w in words[:n]):
+    fail("frame 0 doesn't have a sample from every source")
+if status > 20:
+    print("... %d failures in all" % status)
+sys.exit(1 if status else 0)
+EOF
+status=$?
+
+if [[ $status -eq 0 ]] ; then
+  echo "prudaq_collect: sources aligned and gaps filled"
+fi
+exit $status
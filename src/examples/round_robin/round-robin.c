@@ -21,18 +21,12 @@ permissions and limitations under the License.
 #include <libgen.h>
 #include <string.h>
 
-#include <prussdrv.h>
-#include <pruss_intc_mapping.h>
-
 #include <signal.h>
 
-static int bCont = 1;
-
-// header for sharing info between PRUs and application processor
-#include "shared_header.h"
+#include "prudaq.h"
+#include "prudaq_stage.h"
 
-// the PRU clock speed used for GPIO clock generation
-#define PRU_CLK 200e6
+static int bCont = 1;
 
 void sig_handler (int sig) {
   // break out of reading loop
@@ -41,97 +35,121 @@ void sig_handler (int sig) {
 }
 
 
+void usage (char* arg0) {
+  fprintf(stderr, "\nUsage: %s [-s stage.so[:args]]... pru0_code.bin"
+          " pru1_code.bin\n\n"
+          "Each -s adds a stage that processes the amplitude records (see\n"
+          "../stages).\n\n", basename(arg0));
+  exit(EXIT_FAILURE);
+}
+
 int main (int argc, char **argv) {
+  int ch = -1;
+
   if (geteuid() != 0) {
     fprintf(stderr, "Must be root. Try again with sudo.\n");
     return EXIT_FAILURE;
   }
 
-  if (argc != 3) {
-    fprintf(stderr, "Usage: %s pru0_code.bin pru1_code.bin\n", argv[0]);
+  prudaq_chain_t *chain = prudaq_chain_create();
+  if (!chain) {
     return EXIT_FAILURE;
   }
 
+  while (-1 != (ch = getopt(argc, argv, "s:"))) {
+    switch (ch) {
+    case 's':
+      if (0 != prudaq_chain_load(chain, optarg)) {
+        return EXIT_FAILURE;
+      }
+      break;
+    default:
+      usage(argv[0]);
+      break;
+    }
+  }
+
+  if (argc - optind != 2) {
+    usage(argv[0]);
+  }
+
   // install signal handler to catch ctrl-C
   if (SIG_ERR == signal(SIGINT, sig_handler)) {
     perror("Warn: signal handler not installed %d\n");
   }
 
-  // If this segfaults, make sure you're executing as root.
-  prussdrv_init();
-  if (0 != prussdrv_open(PRU_EVTOUT_0)) {
-    fprintf(stderr, "prussdrv_open() failed\n");
+  prudaq_t *daq = prudaq_open();
+  if (!daq) {
     return EXIT_FAILURE;
   }
 
-  tpruss_intc_initdata pruss_intc_initdata = PRUSS_INTC_INITDATA;
-  prussdrv_pruintc_init(&pruss_intc_initdata);
-
-  // Get pointer into the 8KB of shared PRU DRAM where prudaq expects
-  // to share params with prus and the main cpu
-  volatile pruparams_t *pparams = NULL;
-  prussdrv_map_prumem(PRUSS0_SHARED_DATARAM, (void**)&pparams);
-
-  // Pointer into the DDR RAM mapped by the uio_pruss kernel module.
-  volatile uint32_t *shared_ddr = NULL;
-  prussdrv_map_extmem((void**)&shared_ddr);
-  unsigned int shared_ddr_len = prussdrv_extmem_size();
+  fprintf(stderr, "%uB of shared DDR available.\n\n", prudaq_ring_bytes(daq));
 
-  unsigned int physical_address = prussdrv_get_phys_addr((void*)shared_ddr);
-
-  fprintf(stderr,
-          "%uB of shared DDR available.\n Physical (PRU-side) address:%x\n",
-         shared_ddr_len, physical_address);
-  fprintf(stderr, "Virtual (linux-side) address: %p\n\n", shared_ddr);
-
-  pparams->physical_addr = physical_address;
-  pparams->ddr_len       = shared_ddr_len;
-
-  prussdrv_exec_program(0, argv[1]);
-  prussdrv_exec_program(1, argv[2]);
+  // This firmware shares libprudaq's pruparams_t layout (shared_header.h is
+  // a copy of ../../shared_header.h), but PRU0 generates its own fixed
+  // 4MHz clock and round-robin input selection, so it ignores the clock and
+  // input settings and the control channel.
+  if (0 != prudaq_start(daq, argv[optind], argv[optind + 1])) {
+    return EXIT_FAILURE;
+  }
 
-  volatile uint32_t *read_pointer = shared_ddr;
-  volatile uint32_t *buffer_end = shared_ddr + (shared_ddr_len / sizeof(*shared_ddr));
+  // The ring is uncached, so copy each batch out to normal memory before
+  // the stages look at it.
+  uint32_t *local_buf = (uint32_t *) malloc(prudaq_ring_bytes(daq));
+  if (!local_buf) {
+    fprintf(stderr, "Couldn't allocate memory.\n");
+    return EXIT_FAILURE;
+  }
 
-  // Dummy variable so compiler doesn't optimize away our data.
-  uint32_t foo = 0;
   int64_t bytes_read = 0;
+  int64_t next_report = 1048576;
   while (bCont) {
-    uint32_t *write_pointer_virtual =
-      prussdrv_get_virt_addr(pparams->shared_ptr);
-
-    while (read_pointer != write_pointer_virtual) {
-      // Copy to a local array so we're not working in special slow DMA ram
-      uint16_t amplitudes[4];
-      memcpy(amplitudes, (void *) read_pointer, 8);
-
-      for (int i = 0; i < 4; i++) {
-        // Insert code here for doing interesting things with the downsampled
-        // amplitude data.
-        foo += amplitudes[i];
-        bytes_read += sizeof(amplitudes[0]);
-      }
-      // Occasionally report to stderr
-      if (bytes_read % (1048576) == 0) {
-        fprintf(stderr, "Processed %lldMB\n", bytes_read / 1048576);
-        fprintf(stderr,
-                "Most recent amplitude for channel 0:%d  1:%d  4:%d  5:%d\n",
-                amplitudes[0], amplitudes[1], amplitudes[2], amplitudes[3]);
-      }
+    prudaq_span_t spans[2];
+    int span_count = prudaq_acquire(daq, spans);
+
+    // PRU1 writes an 8 byte record of amplitudes for inputs 0, 1, 4 and 5
+    // at a time, and the ring is a whole number of records long, so the
+    // spans are always whole records.
+    uint32_t words = 0;
+    for (int s = 0; s < span_count; s++) {
+      memcpy(&(local_buf[words]), spans[s].words,
+             spans[s].count * sizeof(*local_buf));
+      words += spans[s].count;
+    }
+    prudaq_release(daq);
 
-      read_pointer += (8 / sizeof(*read_pointer));
-      if (read_pointer >= buffer_end) {
-        read_pointer = shared_ddr;
-      }
+    if (words == 0) {
+      usleep(1000);
+      continue;
+    }
+    if (0 != prudaq_chain_process(chain, local_buf, words)) {
+      break;
+    }
+    bytes_read += words * sizeof(*local_buf);
+
+    // Occasionally report to stderr
+    if (bytes_read >= next_report) {
+      const uint16_t *amplitudes = (const uint16_t *) &(local_buf[words - 2]);
+      fprintf(stderr, "Processed %" PRId64 "MB\n", bytes_read / 1048576);
+      fprintf(stderr,
+              "Most recent amplitude for channel 0:%d  1:%d  4:%d  5:%d\n",
+              amplitudes[0], amplitudes[1], amplitudes[2], amplitudes[3]);
+      next_report = (bytes_read / 1048576 + 1) * 1048576;
     }
     usleep(1000);
   }
 
   fprintf(stderr, "All done\n");
 
-  prussdrv_pru_disable(0);
-  prussdrv_pru_disable(1);
-  prussdrv_exit();
+  prudaq_close(daq);
+
+  int status = 0;
+  if (0 != prudaq_chain_flush(chain)) {
+    status = EXIT_FAILURE;
+  }
+  prudaq_chain_report(chain, stderr);
+  prudaq_chain_destroy(chain);
+  free(local_buf);
 
-  return 0;
+  return status;
 }
@@ -23,12 +23,58 @@ permissions and limitations under the License.
 
 // TODO: Consider generating the pasm struct from the C
 
+// PRU cycles PRU0 spends polling ctrl_seq during the high half of every
+// ADC clock cycle.  These come out of high_cycles, so high_cycles must be
+// at least this much bigger than low_cycles' minimum of 6.
+#define CTRL_POLL_CYCLES 4
+
 #ifndef BUILD_WITH_PASM
 
 typedef struct {
+  // Physical address of the start of the shared main memory buffer.
+  // (The PRUs don't go through the virtual memory system, so they
+  // see different memory addresses than the linux side does).
+  // Written by the CPU, read by the PRU
   uint32_t physical_addr;
+  // Length in bytes of the shared main memory buffer
+  // Written by the CPU, read by the PRU
   uint32_t ddr_len;
+
+  // Physical address of where the PRU is going to write next.
+  // Written by the PRU, read by the CPU
   uint32_t shared_ptr;
+  // This 32-bit counter can roll over in about a minute at high sample rates.
+  // Written by the PRU, read by the CPU
+  uint32_t bytes_written;
+
+  // Written by the CPU, read by PRU0 to generate a clock signal.  Measured in
+  // PRU clock cycles (200MHz / 5ns).  low_cycles must be >= 6, and
+  // high_cycles must be >= 6 + CTRL_POLL_CYCLES.
+  uint32_t high_cycles;
+  uint32_t low_cycles;
+
+  // Which input should be selected on each of the two 4:1 analog switches
+  // that sit in front of the two ADC input channels.  This is written
+  // as-is to r30 on PRU0, setting all of its GPIOs as specified (limited
+  // by which pins are enabled in the device tree overlay).
+  // Written by the CPU, read by the PRU
+  uint32_t input_select;
+
+  // Control channel for changing the clock and input selection while PRU0
+  // is running.  The CPU writes the three ctrl_ values below and then
+  // increments ctrl_seq.  PRU0 polls ctrl_seq right after each rising clock
+  // edge, and when it changes, switches to the new values, copies
+  // bytes_written into ctrl_applied_bytes, and finally copies ctrl_seq into
+  // ctrl_ack.  The CPU must not touch the ctrl_ values again until ctrl_ack
+  // catches up with ctrl_seq.
+  // Written by the CPU, read by PRU0
+  uint32_t ctrl_seq;
+  uint32_t ctrl_high_cycles;
+  uint32_t ctrl_low_cycles;
+  uint32_t ctrl_input_select;
+  // Written by PRU0, read by the CPU
+  uint32_t ctrl_ack;
+  uint32_t ctrl_applied_bytes;
 } pruparams_t;
 
 #else
@@ -39,6 +85,16 @@ typedef struct {
   .u32 physical_addr
   .u32 ddr_len
   .u32 shared_ptr
+  .u32 bytes_written
+  .u32 high_cycles
+  .u32 low_cycles
+  .u32 input_select
+  .u32 ctrl_seq
+  .u32 ctrl_high_cycles
+  .u32 ctrl_low_cycles
+  .u32 ctrl_input_select
+  .u32 ctrl_ack
+  .u32 ctrl_applied_bytes
 .ends
 
 #endif
@@ -20,6 +20,10 @@ This generates an ADC clock using GPIO pin P9_31.  It also selects
 the analog switch inputs specified by the host CPU, determining which
 of the inputs 0..3 will be sampled by ADC channel 0, and which of the
 inputs 4..7 will be sampled by ADC channel 1.
+
+Once running, it polls the control channel in shared RAM (see ctrl_seq in
+shared_header.h) once per clock cycle so that the host can change the
+clock rate and input selection without reloading the PRUs.
 */
 
 .origin 0
@@ -38,6 +42,18 @@ inputs 4..7 will be sampled by ADC channel 1.
 #define LOW_COUNTER  r24
 #define LOW_START    r25
 
+// The last ctrl_seq we acted on, and the one we just read
+#define CTRL_SEQ     r26
+#define CTRL_SEQ_NEW r27
+
+// New settings get loaded here from ctrl_high_cycles, ctrl_low_cycles
+// and ctrl_input_select in a single lbbo, so these must be consecutive.
+#define CTRL_VALUES  r1
+#define CTRL_HIGH    r1
+#define CTRL_LOW     r2
+#define CTRL_SELECT  r3
+#define APPLIED_AT   r4
+
 #define SHARED_RAM r29
 
 #define NOP add r0, r0, 0
@@ -52,7 +68,13 @@ TOP:
   lbbo HIGH_COUNT, SHARED_RAM, OFFSET(Params.high_cycles), SIZE(Params.high_cycles)
   lbbo LOW_COUNT, SHARED_RAM, OFFSET(Params.low_cycles), SIZE(Params.low_cycles)
   lbbo r30, SHARED_RAM, OFFSET(Params.input_select), SIZE(Params.input_select)
+  lbbo CTRL_SEQ, SHARED_RAM, OFFSET(Params.ctrl_seq), SIZE(Params.ctrl_seq)
 
+  // Polling the control channel eats into the high half of the cycle
+  sub HIGH_COUNT, HIGH_COUNT, CTRL_POLL_CYCLES
+
+  // New settings from the control channel start over from here
+START_COUNTS:
   mov HIGH_COUNTER, HIGH_COUNT
   mov LOW_COUNTER, LOW_COUNT
 
@@ -104,5 +126,29 @@ WAIT_L:
   // GPIO clock pin P9_31 goes high
   set r30, 0
 
+  // See if the host has posted new settings.  This takes CTRL_POLL_CYCLES,
+  // or a little longer if PRU1 is writing to shared RAM at the same time.
+  lbbo CTRL_SEQ_NEW, SHARED_RAM, OFFSET(Params.ctrl_seq), SIZE(Params.ctrl_seq)
+  qbne APPLY_CTRL, CTRL_SEQ_NEW, CTRL_SEQ
+
   // Start the cycle over, skipping CYCLE_ODD_H if the count is even
   JMP HIGH_START
+
+APPLY_CTRL:
+  // The ADC sampled on the rising edge we just made, so it's safe to
+  // switch inputs.  This high half runs long by the ~20 cycles it takes
+  // to get back to START_COUNTS.
+  mov CTRL_SEQ, CTRL_SEQ_NEW
+  lbbo CTRL_VALUES, SHARED_RAM, OFFSET(Params.ctrl_high_cycles), 12
+  // Switch the analog switches, keeping the clock high
+  or r30, CTRL_SELECT, 1
+  sub HIGH_COUNT, CTRL_HIGH, CTRL_POLL_CYCLES
+  mov LOW_COUNT, CTRL_LOW
+
+  // PRU1 only updates bytes_written during the low half of the cycle, so
+  // this tells the host exactly which sample the change lines up with.
+  lbbo APPLIED_AT, SHARED_RAM, OFFSET(Params.bytes_written), SIZE(Params.bytes_written)
+  sbbo APPLIED_AT, SHARED_RAM, OFFSET(Params.ctrl_applied_bytes), SIZE(Params.ctrl_applied_bytes)
+  sbbo CTRL_SEQ, SHARED_RAM, OFFSET(Params.ctrl_ack), SIZE(Params.ctrl_ack)
+
+  QBA START_COUNTS
@@ -28,14 +28,23 @@ First run 'sudo ./selftest_setup.sh' to set up the 8 GPIO pins as outputs.
 Make sure resistors are connected from GPIO pins to inputs as described
 in the README.md.
 
-Then run this program.  First it'll test input0 and input4 by setting
-P9_11 and P9_15 low, all the other GPIOs high, then verifying that
-it reads values near 0 from the ADC.
+Then run this program.  It loads the PRU firmware once and leaves the ADC
+clock running for the whole test.  First it'll test input0 and input4 by
+setting P9_11 and P9_15 low, all the other GPIOs high, switching the analog
+switches to inputs 0 and 4, then verifying that a few thousand samples
+from each channel are all near 0 and quiet.
 
 Next it'll set P9_11 and P9_15 high, all the other GPIOs low, then verify
-that it reads values near 1023 from the ADC.
+that the samples are all near 1023.
 
 And so on for inputs 1 and 5, then 2 and 6, then 3 and 7.
+
+With -c, it fits a calibration profile instead.  Rather than the bare 10k
+resistors, wire each input so that the GPIO's low and high levels give
+voltages the ADC can read without clipping (e.g. a divider after each
+resistor), and pass the codes an ideal ADC would read for them with -r.
+Each input's offset and gain are fitted to take what it actually reads at
+those levels to the ideal codes, and saved for prudaq_capture -C.
 */
 
 #include <unistd.h>
@@ -44,22 +53,54 @@ And so on for inputs 1 and 5, then 2 and 6, then 3 and 7.
 #include <inttypes.h>
 #include <libgen.h>
 #include <string.h>
-
-#include <prussdrv.h>
-#include <pruss_intc_mapping.h>
+#include <fcntl.h>
+#include <math.h>
 
 #include <signal.h>
 #include <time.h>
 
-// Header for sharing info between PRUs and application processor
-#include "shared_header.h"
+#include "prudaq.h"
+#include "prudaq_calibration.h"
 
 
 // Used by sig_handler to tell us when to shutdown
 static int bCont = 1;
 
-// The PRUs run at 200MHz
-#define PRU_CLK 200e6
+// Number of samples to skip after the first sample taken on the new inputs
+// before we start collecting statistics.  This gives the input filters and
+// the analog switch's capacitance time to charge through the 10k test
+// resistors.
+#define SETTLE_SAMPLES 256
+
+// Pass/fail limits, in ADC codes.  A low input must average at most
+// LOW_MAX_CODE, a high input at least HIGH_MIN_CODE, and no more than
+// 1 in MAX_BAD_RATIO samples may fall on the wrong side of those limits.
+#define LOW_MAX_CODE 20
+#define HIGH_MIN_CODE 1020
+#define MAX_BAD_RATIO 1000
+// Maximum standard deviation of the samples, in codes.
+#define MAX_NOISE 4.0
+
+// GPIO numbers for P9_11, P9_12, P9_13, P9_14, P9_15, P9_16, P9_23
+// and P9_24.  See selftest_setup.sh for what these mean.
+static const int gpio_numbers[8] = {30, 60, 31, 50, 48, 51, 49, 15};
+
+// The sysfs value files stay open for the whole test so that switching
+// levels is a single write per pin.
+static int gpio_fds[8] = {-1, -1, -1, -1, -1, -1, -1, -1};
+// Last level written to each pin, or -1 if we don't know yet.
+static int gpio_levels[8] = {-1, -1, -1, -1, -1, -1, -1, -1};
+
+typedef struct {
+  uint32_t histogram[1024];
+  uint32_t count;
+  uint16_t min;
+  uint16_t max;
+  double mean;
+  double noise;
+  // Samples on the wrong side of LOW_MAX_CODE or HIGH_MIN_CODE
+  uint32_t bad;
+} channel_stats_t;
 
 void sig_handler (int sig) {
   // break out of reading loop
@@ -67,9 +108,45 @@ void sig_handler (int sig) {
   return;
 }
 
+void usage (char* arg0) {
+  fprintf(stderr, "\nUsage: %s [flags]\n", basename(arg0));
+
+  fprintf(stderr, "\n"
+          "  -f freq\t gpio based clock frequency (default: 1000000)\n"
+          "  -n count\t samples to check per input and level (default: 4096)\n"
+          "  -c profile\t instead of checking for 0 and 1023, fit each input's\n"
+          "\t\t offset and gain to the reference levels given with -r, and\n"
+          "\t\t save them to profile.  Linearity tables already in profile\n"
+          "\t\t are kept, and the fit is made on top of them\n"
+          "  -r low:high\t with -c, what an ideal ADC would read with the GPIOs\n"
+          "\t\t low and high, in codes\n\n"
+         );
+  exit(EXIT_FAILURE);
+}
+
+int gpio_open(void) {
+  for (int i = 0; i < 8; i++) {
+    char fn[255];
+    sprintf(fn, "/sys/class/gpio/gpio%d/value", gpio_numbers[i]);
+    gpio_fds[i] = open(fn, O_WRONLY);
+    if (gpio_fds[i] < 0) {
+      fprintf(stderr, "Failed to open %s. (Did you run selftest_setup.sh?)\n", fn);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void gpio_close(void) {
+  for (int i = 0; i < 8; i++) {
+    if (gpio_fds[i] >= 0) {
+      close(gpio_fds[i]);
+      gpio_fds[i] = -1;
+    }
+  }
+}
+
 int gpio_set(int channel0_input, int channel1_input, int level) {
-  // See selftest_pins.sh for what these mean
-  int gpio_numbers[] = {30, 60, 31, 50, 48, 51, 49, 15};
   for (int i = 0; i < 8; i++) {
     int state = 0;
     if (i == channel0_input || i == channel1_input) {
@@ -78,93 +155,154 @@ int gpio_set(int channel0_input, int channel1_input, int level) {
       state = !level;
     }
 
-    char *zero_or_one = NULL;
-    if (state) {
-      zero_or_one = "1";
-    } else {
-      zero_or_one = "0";
-    }
+    if (state == gpio_levels[i]) continue;
 
-    char fn[255];
-    sprintf(fn, "/sys/class/gpio/gpio%d/value", gpio_numbers[i]);
-    //fprintf(stderr, "Writing %s to %s\n", zero_or_one, fn);
-    FILE *gpio_value_file = fopen(fn, "w");
-    if (gpio_value_file == NULL) {
-      fprintf(stderr, "Failed to open %s. (Did you run selftest_stup.sh?)\n", fn);
+    // sysfs attributes are always written from the start of the file
+    if (1 != pwrite(gpio_fds[i], state ? "1" : "0", 1, 0)) {
+      fprintf(stderr, "Failed to write %d to gpio%d.\n", state, gpio_numbers[i]);
       return -1;
     }
-    if (!fputs(zero_or_one, gpio_value_file)) {
-      fprintf(stderr, "Failed to write %s to %s.\n", zero_or_one, fn);
-      return -1;
-    }
-    fclose(gpio_value_file);
+    gpio_levels[i] = state;
   }
   return 0;
 }
 
-int init_and_sample(volatile pruparams_t *pparams,
-                    volatile uint32_t *shared_ddr,
-                    int channel0_input, int channel1_input,
-                    uint16_t *channel0, uint16_t *channel1) {
-  // Decide the value that'll get written to PRU0's register r30
-  // See the docs for how bits in r30 correspond to the INPUT0A/
-  // INPUT0B/INPUT1A/INPUT1B control lines on the analog switches.
-  uint32_t pru0r30 = 0;
-  if (channel0_input < 0 || channel0_input > 3) return -1;
-  switch (channel0_input) {
-    case 0: break;
-    case 1: pru0r30 |= (1 << 1); break;
-    case 2: pru0r30 |= (1 << 2); break;
-    case 3: pru0r30 |= (1 << 1) | (1 << 2); break;
-  }
-  if (channel1_input < 4 || channel1_input > 7) return -1;
-  switch (channel1_input) {
-    case 4: break;
-    case 5: pru0r30 |= (1 << 3); break;
-    case 6: pru0r30 |= (1 << 5); break;
-    case 7: pru0r30 |= (1 << 3) | (1 << 5); break;
+double elapsed(struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Switches to the given settings, then drains the ring until the PRUs have
+// taken SETTLE_SAMPLES + count samples with them, copying the last count
+// of them into samples.
+int sample(prudaq_t *daq, const prudaq_settings_t *settings,
+           uint32_t *samples, uint32_t count) {
+  if (0 != prudaq_configure(daq, settings)) {
+    return -1;
   }
-  pparams->input_select = pru0r30;
-
-  // Load the .bin files into PRU0 and PRU1
-  prussdrv_exec_program(0, "pru0.bin");
-  prussdrv_exec_program(1, "pru1.bin");
-
-  time_t now = time(NULL);
-  time_t start_time = now;
-
-  uint32_t write_index = 0;
-  // Ignore the first few samples since the AD9201 has 3-cycle
-  // pipeline latency.
-  while (bCont && (write_index < 8)) {
-    uint32_t *write_pointer_virtual = prussdrv_get_virt_addr(pparams->shared_ptr);
-    write_index = write_pointer_virtual - shared_ddr;
-    now = time(NULL);
-
-    // Give up if it takes longer than 2s for data to arrive
-    int max_wait = 2;
-    if (now > start_time + max_wait) {
+
+  // Index of the first sample to keep, once we know when PRU0 switched
+  uint64_t first = UINT64_MAX;
+  uint32_t collected = 0;
+
+  struct timespec start_time;
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+  while (bCont && collected < count) {
+    // Give up if it takes longer than 1s for data to arrive
+    if (elapsed(&start_time) > 1.0) {
       fprintf(stderr, "Timeout waiting for data from ADC."
                       "  (Did you install the clock jumper?)\n");
       return -1;
     }
+    if (prudaq_backlog(daq) > prudaq_ring_bytes(daq)) {
+      fprintf(stderr, "Ring buffer overran while sampling.  Try a lower -f.\n");
+      return -1;
+    }
+
+    prudaq_settings_t applied;
+    uint64_t switched_at;
+    if (prudaq_poll_settings(daq, &applied, &switched_at) &&
+        0 == memcmp(&applied, settings, sizeof(applied))) {
+      first = switched_at + SETTLE_SAMPLES;
+    }
+
+    prudaq_span_t spans[2];
+    int span_count = prudaq_acquire(daq, spans);
+    uint64_t index = prudaq_samples_read(daq);
+    for (int i = 0; i < span_count; i++) {
+      uint64_t end = index + spans[i].count;
+      if (end > first && collected < count) {
+        uint32_t skip = first > index ? first - index : 0;
+        uint32_t take = spans[i].count - skip;
+        if (take > count - collected) {
+          take = count - collected;
+        }
+        memcpy(&(samples[collected]), &(spans[i].words[skip]),
+               take * sizeof(*samples));
+        collected += take;
+      }
+      index = end;
+    }
+    prudaq_release(daq);
 
-    usleep(10000);
+    usleep(100);
   }
   if (!bCont) return -1;
 
-  uint32_t sample = shared_ddr[7];
-  *channel0 = sample & 0xffff;
-  *channel1 = (sample >> 16) & 0xffff;
+  return 0;
+}
 
-  prussdrv_pru_disable(0);
-  prussdrv_pru_disable(1);
+void compute_stats(channel_stats_t *stats, int level) {
+  uint64_t sum = 0;
+  uint64_t sum_squares = 0;
+  stats->min = 1023;
+  stats->max = 0;
+  stats->bad = 0;
+  for (int code = 0; code < 1024; code++) {
+    uint32_t n = stats->histogram[code];
+    if (n == 0) continue;
+    if (code < stats->min) stats->min = code;
+    if (code > stats->max) stats->max = code;
+    sum += (uint64_t) n * code;
+    sum_squares += (uint64_t) n * code * code;
+    if (level ? code < HIGH_MIN_CODE : code > LOW_MAX_CODE) {
+      stats->bad += n;
+    }
+  }
+  stats->mean = (double) sum / stats->count;
+  double variance = (double) sum_squares / stats->count - stats->mean * stats->mean;
+  stats->noise = variance > 0 ? sqrt(variance) : 0;
+}
 
-  return 0;
+// Mean of the samples after the input's linearity table
+double linear_mean(const channel_stats_t *stats,
+                   const prudaq_calibration_t *calibration, int input) {
+  double sum = 0;
+  for (int code = 0; code < 1024; code++) {
+    sum += stats->histogram[code] *
+           prudaq_calibration_linear(calibration, input, code);
+  }
+  return sum / stats->count;
+}
+
+int check_channel(channel_stats_t *stats, int input, int level) {
+  int passed = 1;
+  if (level == 0 && stats->mean > LOW_MAX_CODE) {
+    fprintf(stderr, "FAIL: Expected input %d to be ~0 but got %.1f\n",
+            input, stats->mean);
+    passed = 0;
+  }
+  if (level == 1 && stats->mean < HIGH_MIN_CODE) {
+    fprintf(stderr, "FAIL: Expected input %d to be ~1023 but got %.1f\n",
+            input, stats->mean);
+    passed = 0;
+  }
+  if (stats->noise > MAX_NOISE) {
+    fprintf(stderr, "FAIL: Input %d is noisy: %.2f codes RMS (max %.1f)\n",
+            input, stats->noise, MAX_NOISE);
+    passed = 0;
+  }
+  if (stats->bad * MAX_BAD_RATIO > stats->count) {
+    fprintf(stderr, "FAIL: %u of %u samples on input %d were out of range"
+            " (codes %hu to %hu)\n",
+            stats->bad, stats->count, input, stats->min, stats->max);
+    passed = 0;
+  }
+  return passed;
 }
 
 int main (int argc, char **argv) {
-  double gpiofreq = 1000;
+  int ch = -1;
+  double gpiofreq = 1e6;
+  uint32_t count = 4096;
+  char *profile_fname = NULL;
+  double low_ref = -1, high_ref = -1;
+  prudaq_calibration_t *calibration = NULL;
+  // For -c: each input's mean reading at each level, and whether it clipped
+  double means[8][2];
+  int clipped[8] = {0};
 
   // Make sure we're root
   if (geteuid() != 0) {
@@ -172,124 +310,205 @@ int main (int argc, char **argv) {
     return EXIT_FAILURE;
   }
 
-  // Install signal handler to catch ctrl-C
-  if (SIG_ERR == signal(SIGINT, sig_handler)) {
-    perror("Warn: signal handler not installed %d\n");
+  // Process command line flags
+  while (-1 != (ch = getopt(argc, argv, "f:n:c:r:"))) {
+    switch (ch) {
+    case 'f':
+      gpiofreq = strtod(optarg, NULL);
+      break;
+    case 'n':
+      count = strtoul(optarg, NULL, 0);
+      if (count < 1) {
+        fprintf(stderr, "\n-n value must be at least 1\n");
+        usage(argv[0]);
+      }
+      break;
+    case 'c':
+      profile_fname = optarg;
+      break;
+    case 'r':
+      if (2 != sscanf(optarg, "%lf:%lf", &low_ref, &high_ref) ||
+          low_ref == high_ref) {
+        fprintf(stderr, "\n-r needs two different levels, e.g. 100:900\n");
+        usage(argv[0]);
+      }
+      break;
+    default:
+      usage(argv[0]);
+      break;
+    }
   }
 
-  // This segfaults if we're not root.
-  prussdrv_init();
-  if (0 != prussdrv_open(PRU_EVTOUT_0)) {
-    fprintf(stderr,
-            "prussdrv_open() failed. (Did you forget to run setup.sh?)\n");
-    return EXIT_FAILURE;
+  if (profile_fname) {
+    if (low_ref < 0) {
+      fprintf(stderr, "\n-c needs the reference levels from -r\n");
+      usage(argv[0]);
+    }
+    // Refit an existing profile so that its linearity tables survive
+    calibration = (0 == access(profile_fname, F_OK)) ?
+                  prudaq_calibration_load(profile_fname,
+                                          PRUDAQ_CALIBRATED_FLOAT) :
+                  prudaq_calibration_create(PRUDAQ_CALIBRATED_FLOAT);
+    if (!calibration) {
+      return EXIT_FAILURE;
+    }
   }
 
-  tpruss_intc_initdata pruss_intc_initdata = PRUSS_INTC_INITDATA;
-  prussdrv_pruintc_init(&pruss_intc_initdata);
+  // Install signal handler to catch ctrl-C
+  if (SIG_ERR == signal(SIGINT, sig_handler)) {
+    perror("Warn: signal handler not installed %d\n");
+  }
 
-  // Get pointer into the 8KB of shared PRU DRAM where prudaq expects
-  // to share params with prus and the main cpu
-  volatile pruparams_t *pparams = NULL;
-  prussdrv_map_prumem(PRUSS0_SHARED_DATARAM, (void**)&pparams);
+  // Everything from here on is released at cleanup, however we get there
+  int status = EXIT_FAILURE;
+  prudaq_t *daq = NULL;
+  uint32_t *samples = NULL;
 
-  // Pointer into the DDR RAM mapped by the uio_pruss kernel module.
-  volatile uint32_t *shared_ddr = NULL;
-  prussdrv_map_extmem((void**)&shared_ddr);
-  unsigned int shared_ddr_len = prussdrv_extmem_size();
-  unsigned int physical_address = prussdrv_get_phys_addr((void*)shared_ddr);
+  if (0 != gpio_open()) {
+    goto cleanup;
+  }
 
-  // We'll use the first 8 bytes of PRU memory to tell it where the
-  // shared segment of system memory is.
-  pparams->physical_addr = physical_address;
-  pparams->ddr_len       = shared_ddr_len;
+  daq = prudaq_open();
+  if (!daq) {
+    goto cleanup;
+  }
 
-  // Calculate the GPIO clock high and low cycle counts.
-  // Adding 0.5 and truncating is equivalent to rounding
-  int cycles = (PRU_CLK/gpiofreq + 0.5);
-  fprintf(stderr, "Actual GPIO clock speed is %.2fHz\n", PRU_CLK/((float)cycles));
+  samples = (uint32_t *) malloc(count * sizeof(*samples));
+  if (!samples) {
+    fprintf(stderr, "Couldn't allocate memory.\n");
+    goto cleanup;
+  }
 
-  if (cycles < 12) {
-    fprintf(stderr, "Requested frequency too high (max: 16666666)\n");
-    return EXIT_FAILURE;
+  prudaq_settings_t settings = { gpiofreq, 0, 4 };
+  if (0 != prudaq_configure(daq, &settings)) {
+    goto cleanup;
+  }
+  uint32_t high_cycles, low_cycles;
+  prudaq_clock_cycles(gpiofreq, &high_cycles, &low_cycles);
+  fprintf(stderr, "Actual GPIO clock speed is %.2fHz\n",
+          PRUDAQ_PRU_CLK/((float) (high_cycles + low_cycles)));
+
+  struct timespec start_time;
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+  // Load the .bin files into PRU0 and PRU1 once.  From here on we only
+  // switch inputs through the control channel and change the GPIO levels.
+  if (0 != prudaq_start(daq, "pru0.bin", "pru1.bin")) {
+    goto cleanup;
   }
-  pparams->high_cycles = cycles/2;
-  pparams->low_cycles  = cycles - pparams->high_cycles;
 
+  static channel_stats_t stats[2];
   int passed = 1;
   for (int i = 0; i < 4; i++) {
-    uint16_t channel0 = 9999;
-    uint16_t channel1 = 9999;
-
     int channel0_input = i;
     int channel1_input = i + 4;
 
     for (int level = 0; level < 2; level++) {
-      fprintf(stderr, "  DEBUG: Testing inputs %d and %d at %s voltage.\n",
-              channel0_input, channel1_input, level ? "full" : "zero");
-
       int result = gpio_set(channel0_input, channel1_input, level);
       if (result != 0) {
         passed = 0;
         break;
       }
-
-      result = init_and_sample(pparams, shared_ddr, i, i + 4,
-                               &channel0, &channel1);
+      settings.channel0_input = channel0_input;
+      settings.channel1_input = channel1_input;
+      result = sample(daq, &settings, samples, count);
       if (result != 0) {
         passed = 0;
         break;
       }
 
-      // The sample data is in the low 10 bits
-      uint16_t sample0 = channel0 & 0x03ff;
-      uint16_t sample1 = channel1 & 0x03ff;
-      // And bit 10 records the state of input0a right now (which won't
-      // affect the sample data for 3 more cycles, but that's okay since
-      // we took several samples with this channel enabled).
-      uint16_t input0a = (channel0 & 0x0400) ? 1:0;
-
-      fprintf(stderr, "  DEBUG: Got %hd and %hd and input0a=%d\n",
-              sample0, sample1, input0a);
-      if (input0a != (channel0_input % 2)) {
-        fprintf(stderr, "FAIL: Expected input0a to be %d but got %d\n",
-                input0a, channel0_input % 2);
+      memset(stats, 0, sizeof(stats));
+      uint32_t input0a_mismatches = 0;
+      for (uint32_t n = 0; n < count; n++) {
+        uint32_t word = samples[n];
+        // The sample data is in the low 10 bits of each half
+        stats[0].histogram[word & 0x03ff]++;
+        stats[1].histogram[(word >> 16) & 0x03ff]++;
+        // And bit 10 records the state of input0a when the sample was read,
+        // which should match the input we selected for every sample since
+        // we skipped past the switch.
+        if (((word >> 10) & 1) != (channel0_input % 2)) {
+          input0a_mismatches++;
+        }
+      }
+      stats[0].count = stats[1].count = count;
+      compute_stats(&stats[0], level);
+      compute_stats(&stats[1], level);
+
+      fprintf(stderr, "  DEBUG: Inputs %d and %d at %s voltage:"
+              " mean %.1f and %.1f, noise %.2f and %.2f\n",
+              channel0_input, channel1_input, level ? "full" : "zero",
+              stats[0].mean, stats[1].mean, stats[0].noise, stats[1].noise);
+
+      if (input0a_mismatches) {
+        fprintf(stderr, "FAIL: Expected input0a to be %d in all %u samples"
+                " but %u were wrong\n",
+                channel0_input % 2, count, input0a_mismatches);
         passed = 0;
       }
+      if (!calibration) {
+        passed &= check_channel(&stats[0], channel0_input, level);
+        passed &= check_channel(&stats[1], channel1_input, level);
+        continue;
+      }
 
-      if (level == 0) {
-        if (sample0 > 20) {
-          fprintf(stderr, "FAIL: Expected input %d to be ~0 but got %hd\n",
-                  channel0_input, sample0);
-          passed = 0;
-        }
-        if (sample1 > 20) {
-          fprintf(stderr, "FAIL: Expected input %d to be ~0 but got %hd\n",
-                  channel1_input, sample1);
-          passed = 0;
-        }
-      } else {
-        if (sample0 < 1020) {
-          fprintf(stderr, "FAIL: Expected input %d to be ~1023 but got %hd\n",
-                  channel0_input, sample0);
+      // Fitting only needs the inputs to be quiet, and not to clip, since
+      // a clipped mean says nothing about the gain.
+      int inputs[2] = { channel0_input, channel1_input };
+      for (int c = 0; c < 2; c++) {
+        if (stats[c].noise > MAX_NOISE) {
+          fprintf(stderr, "FAIL: Input %d is noisy: %.2f codes RMS (max %.1f)\n",
+                  inputs[c], stats[c].noise, MAX_NOISE);
           passed = 0;
         }
-        if (sample1 < 1020) {
-          fprintf(stderr, "FAIL: Expected input %d to be ~1023 but got %hd\n",
-                  channel1_input, sample1);
-          passed = 0;
+        if (stats[c].min == 0 || stats[c].max == 1023) {
+          fprintf(stderr, "WARNING: Input %d clipped at the %s reference"
+                  " (codes %hu to %hu), so it won't be calibrated.  Check"
+                  " the reference wiring.\n", inputs[c],
+                  level ? "high" : "low", stats[c].min, stats[c].max);
+          clipped[inputs[c]] = 1;
         }
+        means[inputs[c]][level] = linear_mean(&stats[c], calibration,
+                                              inputs[c]);
       }
     }
   }
 
-  prussdrv_exit();
+  if (calibration && passed) {
+    for (int input = 0; input < 8; input++) {
+      if (clipped[input]) continue;
+      if (0 != prudaq_calibration_fit(calibration, input, means[input][0],
+                                      low_ref, means[input][1], high_ref)) {
+        fprintf(stderr, "WARNING: Input %d read %.1f at both references,"
+                " so it won't be calibrated\n", input, means[input][0]);
+        continue;
+      }
+      fprintf(stderr, "  Input %d: read %.2f and %.2f for %g and %g\n",
+              input, means[input][0], means[input][1], low_ref, high_ref);
+    }
+    if (0 != prudaq_calibration_save(calibration, profile_fname)) {
+      passed = 0;
+    } else {
+      fprintf(stderr, "Saved calibration profile to %s\n", profile_fname);
+    }
+  }
+  fprintf(stderr, "Test took %.3fs\n", elapsed(&start_time));
 
   if (passed) {
     fprintf(stderr, "SUCCESS: All inputs passed!\n");
-    return 0;
+    status = EXIT_SUCCESS;
+  } else {
+    fprintf(stderr, "FAILURE: Something went wrong.\n");
   }
 
-  fprintf(stderr, "FAILURE: Something went wrong.\n");
-  return EXIT_FAILURE;
+cleanup:
+  if (calibration) {
+    prudaq_calibration_destroy(calibration);
+  }
+  if (daq) {
+    prudaq_close(daq);
+  }
+  gpio_close();
+  free(samples);
+  return status;
 }
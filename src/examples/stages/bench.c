@@ -0,0 +1,121 @@
+/*
+Copyright 2015 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied.  See the License for the specific language governing
+permissions and limitations under the License.
+*/
+
+/*
+Runs a chain of stages over synthetic samples as fast as it can, to find
+out whether they'd keep up with the ADC before trying them on a live
+capture.  For example, to see how many carriers ddc.so can follow at the
+fastest clock:
+  ./bench -s ddc.so:12.5e6:100e3:1e6,2e6,3e6
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <math.h>
+#include <time.h>
+
+#include "prudaq_stage.h"
+
+void usage (char* arg0) {
+  fprintf(stderr, "\nUsage: %s [flags] -s stage.so[:args] ...\n",
+          basename(arg0));
+
+  fprintf(stderr, "\n"
+          "  -f freq\t sample rate to compare against (default: %d, the"
+          " fastest -f)\n"
+          "  -n words\t how many words to run through the chain (default:"
+          " 50000000)\n"
+          "  -b words\t batch size (default: 65536)\n"
+          "  -s stage.so[:args]\t add a stage to the chain\n\n",
+          PRUDAQ_MAX_FREQ);
+  exit(EXIT_FAILURE);
+}
+
+static double now_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+int main (int argc, char **argv) {
+  int ch = -1;
+  double freq = PRUDAQ_MAX_FREQ;
+  uint64_t words = 50000000;
+  uint32_t batch = 65536;
+  prudaq_chain_t *chain = prudaq_chain_create();
+  if (!chain) {
+    return EXIT_FAILURE;
+  }
+
+  // Process command line flags
+  while (-1 != (ch = getopt(argc, argv, "f:n:b:s:"))) {
+    switch (ch) {
+    case 'f':
+      freq = strtod(optarg, NULL);
+      break;
+    case 'n':
+      words = strtod(optarg, NULL);
+      break;
+    case 'b':
+      batch = strtoul(optarg, NULL, 0);
+      break;
+    case 's':
+      if (0 != prudaq_chain_load(chain, optarg)) {
+        return EXIT_FAILURE;
+      }
+      break;
+    default:
+      usage(argv[0]);
+      break;
+    }
+  }
+  if (optind != argc || freq <= 0 || batch < 1) {
+    usage(argv[0]);
+  }
+
+  // A tone on each channel, plus a couple of codes of noise, with the clock
+  // and input select bits set the way PRU1 leaves them
+  uint32_t *samples = (uint32_t *) malloc(batch * sizeof(uint32_t));
+  if (!samples) {
+    fprintf(stderr, "Couldn't allocate memory.\n");
+    return EXIT_FAILURE;
+  }
+  for (uint32_t i = 0; i < batch; i++) {
+    uint32_t ch0 = 512 + 400 * sin(2 * M_PI * i / 8.3) + rand() % 4;
+    uint32_t ch1 = 512 + 200 * sin(2 * M_PI * i / 21.7) + rand() % 4;
+    samples[i] = ch0 | (ch1 << 16) | (1 << 11);
+  }
+
+  double start = now_seconds();
+  for (uint64_t done = 0; done < words; done += batch) {
+    uint32_t count = (words - done < batch) ? words - done : batch;
+    if (0 != prudaq_chain_process(chain, samples, count)) {
+      return EXIT_FAILURE;
+    }
+  }
+  int status = prudaq_chain_flush(chain) ? EXIT_FAILURE : EXIT_SUCCESS;
+  double rate = words / (now_seconds() - start);
+
+  fprintf(stderr, "%.2f Mwords/s: %.2fx -f %g%s, %.2fx the fastest -f\n",
+          rate / 1e6, rate / freq, freq,
+          (rate < freq) ? " (too slow)" : "", rate / PRUDAQ_MAX_FREQ);
+  prudaq_chain_report(chain, stderr);
+  prudaq_chain_destroy(chain);
+  free(samples);
+  return status;
+}
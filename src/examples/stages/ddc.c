@@ -0,0 +1,347 @@
+/*
+Copyright 2015 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied.  See the License for the specific language governing
+permissions and limitations under the License.
+*/
+
+/*
+Digital down-conversion stage: mixes each channel down from one or more
+carrier frequencies to 0Hz, low pass filters the result to the bandwidth
+we're interested in, and passes on only as many I/Q samples as that
+bandwidth needs.
+
+The argument is
+  rate:bandwidth:center[,center...][:decimation]
+all in Hz (or samples/second), e.g. to watch 100kHz around 1.2MHz and
+2.5MHz while sampling at 10MHz:
+  -f 10e6 -s ddc.so:10e6:100e3:1.2e6,2.5e6 -s write.so:iq.raw
+The filter passes the bandwidth either side of each center.  The
+decimation defaults to the largest that keeps the output rate at least
+twice the bandwidth, and can't be any larger, since the I/Q would alias.
+
+For every decimation input words, the rest of the chain gets two words
+per carrier: channel 0's I/Q, then channel 1's, each with I in the low
+16 bits and Q in the high 16 bits as signed integers.  They count in 32nds
+of a code, so a full scale (512 code) carrier comes out with magnitude
+8192.
+
+Everything is fixed point so that it keeps up on the BeagleBone: the
+numerically controlled oscillator is a 32-bit phase accumulator looking up
+a table of Q15 sines, and the filter is a Hamming windowed sinc with 8 taps
+per decimation, which attenuates aliases by around 50dB (as much as a
+10-bit ADC can tell apart).  bench shows how many carriers a board can
+follow at a given -f.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
+#include "prudaq_stage.h"
+
+// The NCO looks up the top TABLE_BITS of its phase
+#define TABLE_BITS 10
+#define TABLE_SIZE (1 << TABLE_BITS)
+
+#define MAX_CARRIERS 8
+#define MAX_DECIMATION 512
+// A multiple of 8, so the filter's dot products are whole NEON vectors
+#define TAPS_PER_DECIMATION 8
+
+// Each carrier has an I and a Q stream for each channel
+#define STREAMS_PER_CARRIER 4
+
+// How many input words are mixed down before filtering
+#define CHUNK 4096
+
+typedef struct {
+  int carriers;
+  uint32_t decimation;
+  // The filter's cutoff, as a fraction of the input rate
+  double cutoff;
+  uint32_t taps;
+  // Input words until the next output, counting down from decimation
+  uint32_t countdown;
+
+  uint32_t phase[MAX_CARRIERS];
+  uint32_t step[MAX_CARRIERS];
+  // cos and -sin of the table index's phase, in Q15, so mixing multiplies
+  // by e^-jwt
+  int16_t cos_table[TABLE_SIZE];
+  int16_t sin_table[TABLE_SIZE];
+
+  int16_t *coefficients;
+  // Each stream keeps the last taps mixed samples from the previous chunk,
+  // followed by the current chunk, so that every output's dot product
+  // reads contiguous memory.
+  int16_t *history;
+  uint32_t history_len;
+
+  uint32_t *out;
+  uint32_t out_len;
+} ddc_t;
+
+static int16_t *stream(ddc_t *ddc, int s) {
+  return ddc->history + s * ddc->history_len;
+}
+
+// Low pass filter with its cutoff at the bandwidth, in Q15 with a DC gain
+// of 1
+static void design_filter(ddc_t *ddc) {
+  double cutoff = ddc->cutoff;
+  double h[ddc->taps];
+  double sum = 0;
+  for (uint32_t k = 0; k < ddc->taps; k++) {
+    double t = k - (ddc->taps - 1) / 2.0;
+    double sinc = (t == 0) ? 2 * cutoff :
+                  sin(2 * M_PI * cutoff * t) / (M_PI * t);
+    double window = 0.54 - 0.46 * cos(2 * M_PI * k / (ddc->taps - 1));
+    h[k] = sinc * window;
+    sum += h[k];
+  }
+  // The filter is symmetric, so there's no need to reverse it for the dot
+  // products.
+  for (uint32_t k = 0; k < ddc->taps; k++) {
+    ddc->coefficients[k] = lrint(h[k] / sum * 32768);
+  }
+}
+
+static int init(const char *args, void **state) {
+  ddc_t *ddc = (ddc_t *) calloc(1, sizeof(ddc_t));
+  if (!ddc) {
+    fprintf(stderr, "Couldn't allocate memory.\n");
+    return -1;
+  }
+
+  char *end;
+  double rate = strtod(args, &end);
+  double bandwidth = (*end == ':') ? strtod(end + 1, &end) : 0;
+  double centers[MAX_CARRIERS];
+  while (*end == ':' || (*end == ',' && ddc->carriers > 0)) {
+    if (ddc->carriers == MAX_CARRIERS) {
+      fprintf(stderr, "ddc: at most %d carriers\n", MAX_CARRIERS);
+      free(ddc);
+      return -1;
+    }
+    centers[ddc->carriers++] = strtod(end + 1, &end);
+    if (*end != ',') break;
+  }
+  ddc->decimation = (*end == ':') ? strtoul(end + 1, &end, 0) :
+                    (bandwidth > 0) ? rate / (2 * bandwidth) : 0;
+  if (ddc->decimation < 1) ddc->decimation = 1;
+
+  if (*end || rate <= 0 || bandwidth <= 0 || bandwidth > rate / 2 ||
+      ddc->carriers == 0) {
+    fprintf(stderr, "ddc: needs rate:bandwidth:center[,center...]"
+            "[:decimation], e.g. 10e6:100e3:1.2e6\n");
+    free(ddc);
+    return -1;
+  }
+  if (ddc->decimation > MAX_DECIMATION) {
+    fprintf(stderr, "ddc: can't decimate by more than %d; chain another ddc"
+            " or decimate stage for narrower bandwidths\n", MAX_DECIMATION);
+    free(ddc);
+    return -1;
+  }
+  if (bandwidth > rate / (2 * ddc->decimation)) {
+    fprintf(stderr, "ddc: decimating by %u leaves %g I/Q samples/s, too few"
+            " for %g Hz either side of the center\n", ddc->decimation,
+            rate / ddc->decimation, bandwidth);
+    free(ddc);
+    return -1;
+  }
+  ddc->cutoff = bandwidth / rate;
+
+  for (int c = 0; c < ddc->carriers; c++) {
+    if (fabs(centers[c]) >= rate / 2) {
+      fprintf(stderr, "ddc: %g Hz is above the Nyquist frequency\n",
+              centers[c]);
+      free(ddc);
+      return -1;
+    }
+    // Negative frequencies wrap around to the top of the phase range
+    ddc->step[c] = (uint32_t) (int64_t) llrint(centers[c] / rate * 4294967296.0);
+  }
+  for (int i = 0; i < TABLE_SIZE; i++) {
+    double phase = 2 * M_PI * i / TABLE_SIZE;
+    ddc->cos_table[i] = lrint(32767 * cos(phase));
+    ddc->sin_table[i] = lrint(-32767 * sin(phase));
+  }
+
+  ddc->taps = TAPS_PER_DECIMATION * ddc->decimation;
+  ddc->countdown = ddc->decimation;
+  ddc->history_len = ddc->taps + CHUNK;
+  ddc->coefficients = (int16_t *) malloc(ddc->taps * sizeof(int16_t));
+  ddc->history = (int16_t *) calloc(STREAMS_PER_CARRIER * ddc->carriers *
+                                    ddc->history_len, sizeof(int16_t));
+  if (!ddc->coefficients || !ddc->history) {
+    fprintf(stderr, "Couldn't allocate memory.\n");
+    free(ddc->coefficients);
+    free(ddc->history);
+    free(ddc);
+    return -1;
+  }
+  design_filter(ddc);
+
+  fprintf(stderr, "ddc: %d carrier(s), decimating by %u with %u taps for"
+          " %g I/Q samples/s\n", ddc->carriers, ddc->decimation, ddc->taps,
+          rate / ddc->decimation);
+  *state = ddc;
+  return 0;
+}
+
+// Mixes count words (at most CHUNK) down into each carrier's streams,
+// after the taps samples kept from last time.
+static void mix(ddc_t *ddc, const uint32_t *words, uint32_t count) {
+  uint32_t shift = 32 - TABLE_BITS;
+  for (int c = 0; c < ddc->carriers; c++) {
+    int16_t *i0 = stream(ddc, c * STREAMS_PER_CARRIER) + ddc->taps;
+    int16_t *q0 = stream(ddc, c * STREAMS_PER_CARRIER + 1) + ddc->taps;
+    int16_t *i1 = stream(ddc, c * STREAMS_PER_CARRIER + 2) + ddc->taps;
+    int16_t *q1 = stream(ddc, c * STREAMS_PER_CARRIER + 3) + ddc->taps;
+    uint32_t phase = ddc->phase[c];
+    uint32_t step = ddc->step[c];
+    uint32_t n = 0;
+
+#ifdef __ARM_NEON__
+    const uint16x8_t data_mask = vdupq_n_u16(0x03ff);
+    const int16x8_t midscale = vdupq_n_s16(512);
+    for (; n + 8 <= count; n += 8) {
+      // Table lookups don't vectorize, so gather them first.
+      int16_t cos_lanes[8], sin_lanes[8];
+      for (int k = 0; k < 8; k++) {
+        cos_lanes[k] = ddc->cos_table[phase >> shift];
+        sin_lanes[k] = ddc->sin_table[phase >> shift];
+        phase += step;
+      }
+      int16x8_t cos_v = vld1q_s16(cos_lanes);
+      int16x8_t sin_v = vld1q_s16(sin_lanes);
+
+      // De-interleaves channel 0 (low halves) from channel 1 (high halves)
+      uint16x8x2_t halves = vld2q_u16((const uint16_t *) &words[n]);
+      // Centers the 10-bit codes on 0 and scales them up to use the
+      // precision that vqdmulhq_s16's (a * b) >> 15 would otherwise lose
+      int16x8_t x0 = vshlq_n_s16(vsubq_s16(vreinterpretq_s16_u16(
+          vandq_u16(halves.val[0], data_mask)), midscale), 5);
+      int16x8_t x1 = vshlq_n_s16(vsubq_s16(vreinterpretq_s16_u16(
+          vandq_u16(halves.val[1], data_mask)), midscale), 5);
+
+      vst1q_s16(&i0[n], vqdmulhq_s16(x0, cos_v));
+      vst1q_s16(&q0[n], vqdmulhq_s16(x0, sin_v));
+      vst1q_s16(&i1[n], vqdmulhq_s16(x1, cos_v));
+      vst1q_s16(&q1[n], vqdmulhq_s16(x1, sin_v));
+    }
+#endif
+
+    for (; n < count; n++) {
+      int32_t x0 = ((int32_t) (words[n] & 0x03ff) - 512) << 5;
+      int32_t x1 = ((int32_t) ((words[n] >> 16) & 0x03ff) - 512) << 5;
+      int32_t cos_n = ddc->cos_table[phase >> shift];
+      int32_t sin_n = ddc->sin_table[phase >> shift];
+      i0[n] = (x0 * cos_n) >> 15;
+      q0[n] = (x0 * sin_n) >> 15;
+      i1[n] = (x1 * cos_n) >> 15;
+      q1[n] = (x1 * sin_n) >> 15;
+      phase += step;
+    }
+    ddc->phase[c] = phase;
+  }
+}
+
+// Filters one output sample from the taps mixed samples ending at x.  With
+// inputs within +/-2^14 and coefficients summing to 2^15, the sum fits in
+// 32 bits.
+static int16_t filter(const int16_t *x, const int16_t *h, uint32_t taps) {
+  int32_t sum = 0;
+  uint32_t k = 0;
+#ifdef __ARM_NEON__
+  int32x4_t acc = vdupq_n_s32(0);
+  for (; k < taps; k += 8) {
+    int16x8_t xv = vld1q_s16(&x[k]);
+    int16x8_t hv = vld1q_s16(&h[k]);
+    acc = vmlal_s16(acc, vget_low_s16(xv), vget_low_s16(hv));
+    acc = vmlal_s16(acc, vget_high_s16(xv), vget_high_s16(hv));
+  }
+  int32x2_t pair = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+  sum = vget_lane_s32(vpadd_s32(pair, pair), 0);
+#endif
+  for (; k < taps; k++) {
+    sum += x[k] * h[k];
+  }
+  return (sum + (1 << 14)) >> 15;
+}
+
+static int process_batch(void *state, prudaq_span_t *batch) {
+  ddc_t *ddc = (ddc_t *) state;
+
+  // Batches are usually the same size, so this rarely reallocates
+  uint32_t most = (batch->count / ddc->decimation + 1) * 2 * ddc->carriers;
+  if (most > ddc->out_len) {
+    free(ddc->out);
+    ddc->out = (uint32_t *) malloc(most * sizeof(uint32_t));
+    if (!ddc->out) {
+      fprintf(stderr, "Couldn't allocate memory.\n");
+      ddc->out_len = 0;
+      return -1;
+    }
+    ddc->out_len = most;
+  }
+
+  uint32_t *out = ddc->out;
+  int streams = STREAMS_PER_CARRIER * ddc->carriers;
+  for (uint32_t start = 0; start < batch->count; start += CHUNK) {
+    uint32_t count = batch->count - start;
+    if (count > CHUNK) count = CHUNK;
+    mix(ddc, &batch->words[start], count);
+
+    // Output n's window ends with the nth mixed sample of the chunk, and
+    // starts taps samples earlier.
+    uint32_t n = ddc->countdown;
+    for (; n <= count; n += ddc->decimation) {
+      for (int s = 0; s < streams; s += 2) {
+        int16_t i = filter(stream(ddc, s) + n, ddc->coefficients, ddc->taps);
+        int16_t q = filter(stream(ddc, s + 1) + n, ddc->coefficients,
+                           ddc->taps);
+        *out++ = (uint16_t) i | ((uint32_t) (uint16_t) q << 16);
+      }
+    }
+    ddc->countdown = n - count;
+
+    // Keep the end of this chunk for the next one's first windows
+    for (int s = 0; s < streams; s++) {
+      memmove(stream(ddc, s), stream(ddc, s) + count,
+              ddc->taps * sizeof(int16_t));
+    }
+  }
+
+  batch->words = ddc->out;
+  batch->count = out - ddc->out;
+  return 0;
+}
+
+static void fini(void *state) {
+  ddc_t *ddc = (ddc_t *) state;
+  free(ddc->coefficients);
+  free(ddc->history);
+  free(ddc->out);
+  free(ddc);
+}
+
+const prudaq_stage_t prudaq_stage = {
+  PRUDAQ_STAGE_ABI, "ddc", init, process_batch, NULL, fini
+};
@@ -0,0 +1,89 @@
+/*
+Copyright 2015 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied.  See the License for the specific language governing
+permissions and limitations under the License.
+*/
+
+/*
+Example stage that passes on only every Nth word of its input, showing how
+a stage hands the rest of the chain its own output.  The argument is N
+(default: 10).  For example, to print stats for every 100th sample:
+  -s decimate.so:100 -s stats.so
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "prudaq_stage.h"
+
+typedef struct {
+  uint32_t factor;
+  // How many words to skip before the next one we keep
+  uint32_t skip;
+  uint32_t *out;
+  uint32_t out_len;
+} decimate_t;
+
+static int init(const char *args, void **state) {
+  decimate_t *decimate = (decimate_t *) calloc(1, sizeof(decimate_t));
+  if (!decimate) {
+    fprintf(stderr, "Couldn't allocate memory.\n");
+    return -1;
+  }
+  decimate->factor = *args ? strtoul(args, NULL, 0) : 10;
+  if (decimate->factor < 1) {
+    fprintf(stderr, "decimate: factor must be at least 1\n");
+    free(decimate);
+    return -1;
+  }
+  *state = decimate;
+  return 0;
+}
+
+static int process_batch(void *state, prudaq_span_t *batch) {
+  decimate_t *decimate = (decimate_t *) state;
+
+  // Batches are usually the same size, so this rarely reallocates
+  uint32_t most = batch->count / decimate->factor + 1;
+  if (most > decimate->out_len) {
+    free(decimate->out);
+    decimate->out = (uint32_t *) malloc(most * sizeof(uint32_t));
+    if (!decimate->out) {
+      fprintf(stderr, "Couldn't allocate memory.\n");
+      decimate->out_len = 0;
+      return -1;
+    }
+    decimate->out_len = most;
+  }
+
+  uint32_t kept = 0;
+  uint32_t i = decimate->skip;
+  for (; i < batch->count; i += decimate->factor) {
+    decimate->out[kept++] = batch->words[i];
+  }
+  decimate->skip = i - batch->count;
+
+  batch->words = decimate->out;
+  batch->count = kept;
+  return 0;
+}
+
+static void fini(void *state) {
+  decimate_t *decimate = (decimate_t *) state;
+  free(decimate->out);
+  free(decimate);
+}
+
+const prudaq_stage_t prudaq_stage = {
+  PRUDAQ_STAGE_ABI, "decimate", init, process_batch, NULL, fini
+};
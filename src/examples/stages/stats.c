@@ -0,0 +1,103 @@
+/*
+Copyright 2015 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied.  See the License for the specific language governing
+permissions and limitations under the License.
+*/
+
+/*
+Example stage that keeps the min, max and mean of each 16-bit lane of its
+input and prints them at the end, passing the input along unchanged.
+
+The argument is the number of words per record (default: 1), so for
+prudaq_capture's words (channel 0, channel 1):
+  -s stats.so
+and for round-robin's 8-byte records (inputs 0, 1, 4 and 5):
+  -s stats.so:2
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "prudaq_stage.h"
+
+#define MAX_LANES 16
+
+typedef struct {
+  int words_per_record;
+  // Which word of a record the next batch starts with
+  int phase;
+  uint16_t min[MAX_LANES];
+  uint16_t max[MAX_LANES];
+  uint64_t sum[MAX_LANES];
+  uint64_t count[MAX_LANES];
+} stats_t;
+
+static int init(const char *args, void **state) {
+  stats_t *stats = (stats_t *) calloc(1, sizeof(stats_t));
+  if (!stats) {
+    fprintf(stderr, "Couldn't allocate memory.\n");
+    return -1;
+  }
+  stats->words_per_record = *args ? strtol(args, NULL, 0) : 1;
+  if (stats->words_per_record < 1 ||
+      stats->words_per_record * 2 > MAX_LANES) {
+    fprintf(stderr, "stats: words per record must be 1-%d\n", MAX_LANES / 2);
+    free(stats);
+    return -1;
+  }
+  for (int lane = 0; lane < MAX_LANES; lane++) {
+    stats->min[lane] = UINT16_MAX;
+  }
+  *state = stats;
+  return 0;
+}
+
+static int process_batch(void *state, prudaq_span_t *batch) {
+  stats_t *stats = (stats_t *) state;
+  int word = stats->phase;
+  for (uint32_t i = 0; i < batch->count; i++) {
+    uint16_t halves[2] = { batch->words[i] & 0x03ff,
+                           (batch->words[i] >> 16) & 0x03ff };
+    for (int h = 0; h < 2; h++) {
+      int lane = 2 * word + h;
+      if (halves[h] < stats->min[lane]) stats->min[lane] = halves[h];
+      if (halves[h] > stats->max[lane]) stats->max[lane] = halves[h];
+      stats->sum[lane] += halves[h];
+      stats->count[lane]++;
+    }
+    if (++word == stats->words_per_record) word = 0;
+  }
+  stats->phase = word;
+  return 0;
+}
+
+static int flush(void *state, prudaq_span_t *batch) {
+  stats_t *stats = (stats_t *) state;
+  for (int lane = 0; lane < 2 * stats->words_per_record; lane++) {
+    if (stats->count[lane] == 0) continue;
+    fprintf(stderr, "Lane %d: min %u  max %u  mean %.3f over %" PRIu64
+            " values\n", lane, stats->min[lane], stats->max[lane],
+            (double) stats->sum[lane] / stats->count[lane],
+            stats->count[lane]);
+  }
+  return 0;
+}
+
+static void fini(void *state) {
+  free(state);
+}
+
+const prudaq_stage_t prudaq_stage = {
+  PRUDAQ_STAGE_ABI, "stats", init, process_batch, flush, fini
+};
@@ -0,0 +1,67 @@
+/*
+Copyright 2015 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied.  See the License for the specific language governing
+permissions and limitations under the License.
+*/
+
+/*
+Example stage that writes whatever the stages before it pass on to a file,
+and passes it along unchanged.  The argument is the filename, or "-" for
+stdout.  For example, to save the I/Q from ddc.so instead of the raw
+samples:
+  -o /dev/null -s ddc.so:10e6:100e3:1.2e6 -s write.so:iq.raw
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "prudaq_stage.h"
+
+static int init(const char *args, void **state) {
+  if (!*args) {
+    fprintf(stderr, "write: needs a filename\n");
+    return -1;
+  }
+  FILE *out = stdout;
+  if (0 != strcmp(args, "-")) {
+    out = fopen(args, "w");
+    if (!out) {
+      perror("write: unable to open output file");
+      return -1;
+    }
+  }
+  *state = out;
+  return 0;
+}
+
+static int process_batch(void *state, prudaq_span_t *batch) {
+  FILE *out = (FILE *) state;
+  if (batch->count &&
+      1 != fwrite(batch->words, batch->count * sizeof(uint32_t), 1, out)) {
+    perror("write: couldn't write");
+    return -1;
+  }
+  return 0;
+}
+
+static void fini(void *state) {
+  FILE *out = (FILE *) state;
+  if (out != stdout) {
+    fclose(out);
+  }
+}
+
+const prudaq_stage_t prudaq_stage = {
+  PRUDAQ_STAGE_ABI, "write", init, process_batch, NULL, fini
+};
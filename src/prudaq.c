@@ -0,0 +1,294 @@
+/*
+Copyright 2015 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied.  See the License for the specific language governing
+permissions and limitations under the License.
+*/
+
+/*
+The parts of libprudaq that drive the PRUs.  See prudaq.h.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <prussdrv.h>
+#include <pruss_intc_mapping.h>
+
+#include "prudaq.h"
+// Header for sharing info between PRUs and application processor
+#include "shared_header.h"
+
+// How many samples after ctrl_applied_bytes / 4 the first sample taken with
+// new control channel settings shows up.  PRU0 switches right after rising
+// clock edge n, so edge n + 1 is the first conversion with the new settings.
+// The AD9201's pipeline delays its output by 3 more cycles, and PRU1 writes
+// each word to DDR one cycle after reading it.
+#define CTRL_LATENCY_SAMPLES 5
+
+struct prudaq {
+  // Pointer into the 8KB of shared PRU DRAM where prudaq expects
+  // to share params with prus and the main cpu
+  volatile pruparams_t *pparams;
+  // Pointer into the DDR RAM mapped by the uio_pruss kernel module.
+  volatile uint32_t *shared_ddr;
+  uint32_t ring_words;
+
+  // Where the next unreleased word is, and where the PRU had gotten to as
+  // of the last prudaq_acquire()
+  uint32_t read_index;
+  uint32_t acquired_index;
+  // Counts the same thing as bytes_written in pruparams_t, including
+  // rolling over at 4GB
+  uint32_t bytes_read;
+  uint64_t samples_read;
+
+  int running;
+  // What we've asked PRU0 for, whether it's still being applied, and what
+  // we'll ask for once it is
+  prudaq_settings_t current;
+  int pending;
+  prudaq_settings_t wanted;
+};
+
+// Hands the wanted settings to PRU0 through the control channel.  Returns
+// -1 if PRU0 hasn't applied the previous ones yet.
+static int post_settings(prudaq_t *daq) {
+  volatile pruparams_t *pparams = daq->pparams;
+  if (pparams->ctrl_ack != pparams->ctrl_seq) {
+    return -1;
+  }
+
+  uint32_t high_cycles, low_cycles;
+  prudaq_clock_cycles(daq->wanted.freq, &high_cycles, &low_cycles);
+  pparams->ctrl_high_cycles = high_cycles;
+  pparams->ctrl_low_cycles = low_cycles;
+  pparams->ctrl_input_select = prudaq_input_select(daq->wanted.channel0_input,
+                                                   daq->wanted.channel1_input);
+  // PRU0 mustn't see the new ctrl_seq before the values that go with it
+  __sync_synchronize();
+  pparams->ctrl_seq = pparams->ctrl_seq + 1;
+
+  daq->current = daq->wanted;
+  daq->pending = 1;
+  return 0;
+}
+
+prudaq_t *prudaq_open(void) {
+  prudaq_t *daq = (prudaq_t *) calloc(1, sizeof(*daq));
+  if (!daq) {
+    fprintf(stderr, "Couldn't allocate memory.\n");
+    return NULL;
+  }
+
+  // This segfaults if we're not root.
+  prussdrv_init();
+  if (0 != prussdrv_open(PRU_EVTOUT_0)) {
+    fprintf(stderr,
+            "prussdrv_open() failed. (Did you forget to run setup.sh?)\n");
+    free(daq);
+    return NULL;
+  }
+
+  tpruss_intc_initdata pruss_intc_initdata = PRUSS_INTC_INITDATA;
+  prussdrv_pruintc_init(&pruss_intc_initdata);
+
+  prussdrv_map_prumem(PRUSS0_SHARED_DATARAM, (void**)&(daq->pparams));
+  prussdrv_map_extmem((void**)&(daq->shared_ddr));
+  unsigned int shared_ddr_len = prussdrv_extmem_size();
+  daq->ring_words = shared_ddr_len / sizeof(*(daq->shared_ddr));
+
+  // Tell the PRUs where the shared segment of system memory is.
+  daq->pparams->physical_addr = prussdrv_get_phys_addr((void*)daq->shared_ddr);
+  daq->pparams->ddr_len       = shared_ddr_len;
+
+  prudaq_settings_t defaults = { 1000, 0, 4 };
+  prudaq_configure(daq, &defaults);
+  return daq;
+}
+
+void prudaq_close(prudaq_t *daq) {
+  prudaq_stop(daq);
+  prussdrv_exit();
+  free(daq);
+}
+
+int prudaq_configure(prudaq_t *daq, const prudaq_settings_t *settings) {
+  uint32_t high_cycles, low_cycles;
+  if (0 != prudaq_clock_cycles(settings->freq, &high_cycles, &low_cycles)) {
+    fprintf(stderr, "Requested frequency too high (max: %d)\n",
+            PRUDAQ_MAX_FREQ);
+    return -1;
+  }
+  int32_t select = prudaq_input_select(settings->channel0_input,
+                                       settings->channel1_input);
+  if (select < 0) {
+    fprintf(stderr, "Inputs must be 0-3 for channel 0 and 4-7 for channel 1\n");
+    return -1;
+  }
+
+  daq->wanted = *settings;
+  if (daq->running) {
+    // Until the last change has been reported by prudaq_poll_settings(),
+    // leave this one in wanted for it to post afterwards, so that changes
+    // are reported one at a time and in order.
+    if (!daq->pending) {
+      post_settings(daq);
+    }
+    return 0;
+  }
+
+  daq->pparams->high_cycles  = high_cycles;
+  daq->pparams->low_cycles   = low_cycles;
+  daq->pparams->input_select = select;
+  daq->current = *settings;
+  return 0;
+}
+
+int prudaq_start(prudaq_t *daq, const char *pru0_bin, const char *pru1_bin) {
+  // Changes made while running only went through the control channel, and
+  // one may still be waiting in wanted, so start with the latest settings.
+  uint32_t high_cycles, low_cycles;
+  prudaq_clock_cycles(daq->wanted.freq, &high_cycles, &low_cycles);
+  daq->pparams->high_cycles  = high_cycles;
+  daq->pparams->low_cycles   = low_cycles;
+  daq->pparams->input_select = prudaq_input_select(daq->wanted.channel0_input,
+                                                   daq->wanted.channel1_input);
+  daq->current = daq->wanted;
+
+  // Nothing pending on the control channel
+  daq->pparams->ctrl_seq = 0;
+  daq->pparams->ctrl_ack = 0;
+  daq->pending = 0;
+
+  daq->read_index = 0;
+  daq->acquired_index = 0;
+  daq->bytes_read = 0;
+  daq->samples_read = 0;
+
+  // PRU1 waits for the clock, so start it first.
+  if (0 != prussdrv_exec_program(1, pru1_bin)) {
+    fprintf(stderr, "Couldn't load %s into PRU1\n", pru1_bin);
+    return -1;
+  }
+  if (0 != prussdrv_exec_program(0, pru0_bin)) {
+    fprintf(stderr, "Couldn't load %s into PRU0\n", pru0_bin);
+    prussdrv_pru_disable(1);
+    return -1;
+  }
+  daq->running = 1;
+  return 0;
+}
+
+void prudaq_stop(prudaq_t *daq) {
+  if (!daq->running) return;
+  prussdrv_pru_disable(0);
+  prussdrv_pru_disable(1);
+  daq->running = 0;
+}
+
+int prudaq_acquire(prudaq_t *daq, prudaq_span_t spans[2]) {
+  // Reading from shared memory and PRU RAM is significantly slower than
+  // normal memory, so callers should take everything we hand out here
+  // rather than coming back for every word.
+  uint32_t *write_pointer_virtual =
+    prussdrv_get_virt_addr(daq->pparams->shared_ptr);
+  uint32_t write_index = write_pointer_virtual - daq->shared_ddr;
+  uint32_t read_index = daq->read_index;
+  // The ring's memory is only written by the PRUs, so it's safe to drop
+  // volatile once we've read the write pointer.
+  const uint32_t *ring = (const uint32_t *) daq->shared_ddr;
+
+  daq->acquired_index = write_index;
+  if (read_index == write_index) {
+    // Nothing new since last time
+    return 0;
+  }
+  if (read_index < write_index) {
+    spans[0].words = &(ring[read_index]);
+    spans[0].count = write_index - read_index;
+    return 1;
+  }
+
+  // The write pointer has wrapped around, so hand out the data in two chunks
+  spans[0].words = &(ring[read_index]);
+  spans[0].count = daq->ring_words - read_index;
+  if (write_index == 0) {
+    return 1;
+  }
+  spans[1].words = ring;
+  spans[1].count = write_index;
+  return 2;
+}
+
+void prudaq_release(prudaq_t *daq) {
+  uint32_t words = (daq->acquired_index + daq->ring_words - daq->read_index) %
+                   daq->ring_words;
+  daq->bytes_read += words * sizeof(uint32_t);
+  daq->samples_read += words;
+  daq->read_index = daq->acquired_index;
+}
+
+uint64_t prudaq_samples_read(const prudaq_t *daq) {
+  return daq->samples_read;
+}
+
+uint32_t prudaq_backlog(const prudaq_t *daq) {
+  // There's a race condition here where the PRU will often update
+  // bytes_written just after shared_ptr, so don't worry about small
+  // differences.
+  return daq->pparams->bytes_written - daq->bytes_read;
+}
+
+uint32_t prudaq_check_overrun(prudaq_t *daq) {
+  uint32_t acquired = (daq->acquired_index + daq->ring_words -
+                       daq->read_index) % daq->ring_words;
+  uint32_t written = (daq->pparams->bytes_written - daq->bytes_read) /
+                     sizeof(uint32_t);
+  // The write pointer only tells us where PRU1 is within the ring, so
+  // anything written beyond what we acquired is whole laps, plus whatever
+  // it has written since prudaq_acquire().  bytes_written can also trail
+  // shared_ptr slightly, hence the signed difference.
+  int32_t extra = (int32_t) (written - acquired);
+  if (extra < (int32_t) daq->ring_words) {
+    return 0;
+  }
+  uint32_t lost = extra / daq->ring_words * daq->ring_words;
+  daq->bytes_read += lost * sizeof(uint32_t);
+  daq->samples_read += lost;
+  return lost;
+}
+
+uint32_t prudaq_ring_bytes(const prudaq_t *daq) {
+  return daq->ring_words * sizeof(uint32_t);
+}
+
+int prudaq_poll_settings(prudaq_t *daq, prudaq_settings_t *applied,
+                         uint64_t *sample) {
+  if (!daq->pending || daq->pparams->ctrl_ack != daq->pparams->ctrl_seq) {
+    return 0;
+  }
+
+  // ctrl_applied_bytes counts the same bytes as bytes_read, so the
+  // difference tells us how far the change is from the last sample we
+  // released, even after the counters roll over.
+  int32_t ahead = (int32_t) (daq->pparams->ctrl_applied_bytes - daq->bytes_read);
+  *sample = daq->samples_read + ahead / 4 + CTRL_LATENCY_SAMPLES;
+  *applied = daq->current;
+  daq->pending = 0;
+
+  if (0 != memcmp(&(daq->wanted), &(daq->current), sizeof(daq->wanted))) {
+    post_settings(daq);
+  }
+  return 1;
+}
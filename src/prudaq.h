@@ -0,0 +1,158 @@
+/*
+Copyright 2015 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied.  See the License for the specific language governing
+permissions and limitations under the License.
+*/
+
+/*
+libprudaq: loads the PRU firmware, configures the clock and analog
+switches, and hands out the samples the PRUs write to the shared ring
+buffer in main memory.
+
+A typical program looks like:
+
+  prudaq_t *daq = prudaq_open();
+  prudaq_settings_t settings = { 1e6, 0, 4 };
+  prudaq_configure(daq, &settings);
+  prudaq_start(daq, "pru0.bin", "pru1.bin");
+  while (running) {
+    prudaq_span_t spans[2];
+    int n = prudaq_acquire(daq, spans);
+    for (int i = 0; i < n; i++) {
+      process(spans[i].words, spans[i].count);
+    }
+    prudaq_release(daq);
+    usleep(100);
+  }
+  prudaq_stop(daq);
+  prudaq_close(daq);
+
+The functions that don't take a prudaq_t (prudaq_clock_cycles(),
+prudaq_input_select(), prudaq_mask() and prudaq_demux()) don't touch the
+hardware, so they're also handy for tools that work on captured files.
+*/
+
+#ifndef PRUDAQ_H
+#define PRUDAQ_H
+
+#include <inttypes.h>
+
+// The PRUs run at 200MHz
+#define PRUDAQ_PRU_CLK 200e6
+
+// Fastest GPIO clock PRU0 can generate while polling for new settings
+#define PRUDAQ_MAX_FREQ 12500000
+
+// Keeps just the 10 data bits from each channel of a sample word
+#define PRUDAQ_SAMPLE_MASK 0x03ff03ff
+
+// Opaque handle for the PRUs and their shared memory.  There's only one set
+// of PRUs, so only one can be open at a time.
+typedef struct prudaq prudaq_t;
+
+typedef struct {
+  // GPIO clock frequency in Hz.  (The ADC ignores this when the onboard
+  // clock jumper is installed.)
+  double freq;
+  // Which of inputs 0-3 feeds ADC channel 0, and which of inputs 4-7 feeds
+  // ADC channel 1
+  int channel0_input;
+  int channel1_input;
+} prudaq_settings_t;
+
+// A contiguous run of 32-bit sample words.  Each word holds one sample from
+// channel 0 in the low half and one from channel 1 in the high half, with
+// the clock and input select state in the bits above the 10 data bits.
+typedef struct {
+  const uint32_t *words;
+  uint32_t count;
+} prudaq_span_t;
+
+// Initializes prussdrv and maps the PRU and shared DDR memory.  Must be
+// run as root.  Returns NULL (after explaining why on stderr) on failure.
+prudaq_t *prudaq_open(void);
+
+// Disables the PRUs if they're running and releases everything.
+void prudaq_close(prudaq_t *daq);
+
+// Sets the clock frequency and input selection.  Before prudaq_start() this
+// decides what the PRUs start with.  Once running, the PRUs switch over
+// without stopping; prudaq_poll_settings() reports when.  A change made
+// before the last one has been reported waits for it, and replaces any
+// other change that was waiting.  Returns -1 if the settings are out of
+// range.
+int prudaq_configure(prudaq_t *daq, const prudaq_settings_t *settings);
+
+// Loads the firmware into PRU0 and PRU1 and starts them.  Returns -1 on
+// failure.
+int prudaq_start(prudaq_t *daq, const char *pru0_bin, const char *pru1_bin);
+
+// Halts both PRUs.
+void prudaq_stop(prudaq_t *daq);
+
+// Fills in up to two spans, oldest first, covering everything the PRUs
+// have written since the last prudaq_release().  Returns how many spans
+// were filled in (0 if there's nothing new).  The spans point straight into
+// the shared ring, which is uncached, so consumers that touch each word
+// more than once should copy it out first.  They stay valid until
+// prudaq_release(), as long as the PRUs don't lap us.
+int prudaq_acquire(prudaq_t *daq, prudaq_span_t spans[2]);
+
+// Hands everything returned by the last prudaq_acquire() back to the PRUs.
+void prudaq_release(prudaq_t *daq);
+
+// Total number of sample words released so far.
+uint64_t prudaq_samples_read(const prudaq_t *daq);
+
+// Number of bytes PRU1 has written that haven't been released yet.  Once
+// this exceeds prudaq_ring_bytes(), samples have been lost.  Only
+// meaningful with firmware that maintains bytes_written.
+uint32_t prudaq_backlog(const prudaq_t *daq);
+
+// Call between prudaq_acquire() and prudaq_release(), with firmware that
+// maintains bytes_written, to find out whether PRU1 lapped us since the
+// last prudaq_release().  If so, the spans hold the newest samples and the
+// ones before them were overwritten, so this accounts for the overwritten
+// samples (keeping prudaq_samples_read() and prudaq_poll_settings() sample
+// indices right) and returns how many there were.  Returns 0 otherwise.
+uint32_t prudaq_check_overrun(prudaq_t *daq);
+
+// Size of the shared ring buffer in bytes.
+uint32_t prudaq_ring_bytes(const prudaq_t *daq);
+
+// Checks whether the PRUs have applied settings from prudaq_configure(),
+// and passes along any newer ones that were waiting for them to catch up.
+// Returns 1 after filling in the settings that took effect and the index
+// of the first sample taken with them, or 0 if there's no news.
+int prudaq_poll_settings(prudaq_t *daq, prudaq_settings_t *applied,
+                         uint64_t *sample);
+
+// Splits one period of the GPIO clock into PRU0's high and low cycle counts.
+// Returns -1 if freq is faster than PRU0 can generate.
+int prudaq_clock_cycles(double freq, uint32_t *high_cycles,
+                        uint32_t *low_cycles);
+
+// Returns the value for PRU0's r30 that selects the given inputs, or -1 if
+// they're out of range.
+int32_t prudaq_input_select(int channel0_input, int channel1_input);
+
+// Masks count sample words in place, keeping just the data bits.
+void prudaq_mask(uint32_t *words, uint32_t count);
+
+// Splits count sample words into separate 16-bit samples for each channel,
+// keeping just the 10 data bits.  channel0 or channel1 may be NULL to skip
+// that channel.
+void prudaq_demux(const uint32_t *words, uint16_t *channel0,
+                  uint16_t *channel1, uint32_t count);
+
+#endif
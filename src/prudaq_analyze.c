@@ -0,0 +1,617 @@
+/*
+Copyright 2015 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied.  See the License for the specific language governing
+permissions and limitations under the License.
+*/
+
+/*
+Offline analysis of files written by prudaq_capture.
+
+Maps the whole capture into memory and splits it across threads, each of
+which builds a code histogram for each channel and averages the power
+spectrum of a sample of FFT blocks.  The partial results are merged at the
+end, then reduced to:
+
+ - min, max, mean, RMS and AC RMS.  These are exact, and computed from the
+   merged histogram rather than with another pass over the samples.
+ - DNL and INL from a code density test, for either a ramp (uniform) or
+   a sine wave input.
+ - SNR, SINAD and ENOB, assuming the input is a single tone.
+
+Doesn't need the PRUs, so it also builds on a workstation:
+  make prudaq_analyze
+*/
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define CODES 1024
+
+// How the samples are laid out in the file, matching prudaq_capture's -l
+typedef enum {
+  LAYOUT_INTERLEAVED,
+  LAYOUT_SINGLE,
+} layout_t;
+
+// Which ideal code distribution to compare against for DNL and INL
+typedef enum {
+  MODEL_RAMP,
+  MODEL_SINE,
+} model_t;
+
+typedef struct {
+  int fft_size;
+  // Largest number of FFT blocks a thread should average.  0 means all.
+  int max_blocks;
+} fft_options_t;
+
+// Each thread's share of the work, and its partial results
+typedef struct {
+  const void *data;
+  uint64_t samples;
+  int channels;
+  fft_options_t fft;
+  const float *window;
+  const float *twiddles;
+
+  uint64_t histogram[2][CODES];
+  // Sum of the power spectra of all the blocks analyzed
+  double *spectrum[2];
+  uint64_t blocks;
+} partial_t;
+
+typedef struct {
+  double mean;
+  double rms;
+  double ac_rms;
+  int min;
+  int max;
+  int codes_hit;
+  double dnl_min, dnl_max;
+  double inl_min, inl_max;
+  int peak_bin;
+  double snr;
+  double sinad;
+  double enob;
+} channel_result_t;
+
+void usage (char* arg0) {
+  fprintf(stderr, "\nUsage: %s [flags] capture_file\n", basename(arg0));
+
+  fprintf(stderr, "\n"
+          "  -l layout\t \"interleaved\" (default) for prudaq_capture's 32-bit\n"
+          "\t\t words, or \"single\" for one channel of 16-bit samples\n"
+          "\t\t (prudaq_capture -l 0, -l 1 or one of the -l planar files)\n"
+          "  -t threads\t number of threads (default: one per CPU)\n"
+          "  -n size\t FFT size for SNR/ENOB, a power of 2 (default: 8192),\n"
+          "\t\t or 0 to skip the spectrum\n"
+          "  -a\t\t average every FFT block rather than up to 256 spread\n"
+          "\t\t evenly over the file\n"
+          "  -d model\t input used for DNL/INL: \"sine\" (default) or \"ramp\"\n"
+          "  -r rate\t sample rate in Hz, to report the tone frequency\n"
+          "  -H file\t write each channel's histogram, DNL and INL to file\n\n"
+         );
+  exit(EXIT_FAILURE);
+}
+
+// Builds the twiddle factors for an n-point FFT: cos, sin pairs.
+float *make_twiddles(int n) {
+  float *twiddles = (float *) malloc(n * sizeof(float));
+  if (!twiddles) return NULL;
+  for (int i = 0; i < n / 2; i++) {
+    twiddles[2 * i] = cos(2 * M_PI * i / n);
+    twiddles[2 * i + 1] = -sin(2 * M_PI * i / n);
+  }
+  return twiddles;
+}
+
+// 4-term Blackman-Harris.  Its -92dB sidelobes keep a full-scale tone's
+// leakage below the quantization noise of a 10-bit ADC.
+float *make_window(int n) {
+  float *window = (float *) malloc(n * sizeof(float));
+  if (!window) return NULL;
+  for (int i = 0; i < n; i++) {
+    double x = 2 * M_PI * i / n;
+    window[i] = 0.35875 - 0.48829 * cos(x) + 0.14128 * cos(2 * x) -
+                0.01168 * cos(3 * x);
+  }
+  return window;
+}
+
+// In-place radix-2 FFT of n complex values stored as re, im pairs.
+void fft(float *z, int n, const float *twiddles) {
+  // Bit reversal permutation
+  for (int i = 1, j = 0; i < n; i++) {
+    int bit = n >> 1;
+    for (; j & bit; bit >>= 1) {
+      j ^= bit;
+    }
+    j |= bit;
+    if (i < j) {
+      float re = z[2 * i], im = z[2 * i + 1];
+      z[2 * i] = z[2 * j];
+      z[2 * i + 1] = z[2 * j + 1];
+      z[2 * j] = re;
+      z[2 * j + 1] = im;
+    }
+  }
+
+  for (int len = 2; len <= n; len <<= 1) {
+    int stride = n / len;
+    for (int i = 0; i < n; i += len) {
+      for (int k = 0; k < len / 2; k++) {
+        float wr = twiddles[2 * k * stride];
+        float wi = twiddles[2 * k * stride + 1];
+        float *a = &(z[2 * (i + k)]);
+        float *b = &(z[2 * (i + k + len / 2)]);
+        float br = b[0] * wr - b[1] * wi;
+        float bi = b[0] * wi + b[1] * wr;
+        b[0] = a[0] - br;
+        b[1] = a[1] - bi;
+        a[0] += br;
+        a[1] += bi;
+      }
+    }
+  }
+}
+
+// Adds the power spectrum of one windowed block starting at sample 'first'
+// to the partial results.  Both channels of interleaved data go through a
+// single complex FFT, one as the real part and one as the imaginary part.
+void accumulate_spectrum(partial_t *partial, float *z, uint64_t first) {
+  int n = partial->fft.fft_size;
+  for (int i = 0; i < n; i++) {
+    uint64_t s = first + i;
+    if (partial->channels == 2) {
+      uint32_t word = ((const uint32_t *) partial->data)[s];
+      z[2 * i] = (word & 0x03ff) * partial->window[i];
+      z[2 * i + 1] = ((word >> 16) & 0x03ff) * partial->window[i];
+    } else {
+      z[2 * i] = (((const uint16_t *) partial->data)[s] & 0x03ff) *
+                 partial->window[i];
+      z[2 * i + 1] = 0;
+    }
+  }
+
+  fft(z, n, partial->twiddles);
+
+  for (int k = 0; k <= n / 2; k++) {
+    int m = (n - k) % n;
+    // Z[k] = X[k] + iY[k], and X and Y are real, so X[k] = (Z[k] + Z*[n-k])/2
+    // and Y[k] = (Z[k] - Z*[n-k])/2i
+    double xr = (z[2 * k] + z[2 * m]) / 2;
+    double xi = (z[2 * k + 1] - z[2 * m + 1]) / 2;
+    double yr = (z[2 * k + 1] + z[2 * m + 1]) / 2;
+    double yi = (z[2 * m] - z[2 * k]) / 2;
+    partial->spectrum[0][k] += xr * xr + xi * xi;
+    if (partial->channels == 2) {
+      partial->spectrum[1][k] += yr * yr + yi * yi;
+    }
+  }
+  partial->blocks++;
+}
+
+void *analyze_thread(void *arg) {
+  partial_t *partial = (partial_t *) arg;
+
+  // Consecutive samples often land on the same code, so alternate between
+  // two copies of each histogram to avoid stalling on the previous
+  // increment.
+  static __thread uint64_t histograms[2][2][CODES];
+  memset(histograms, 0, sizeof(histograms));
+
+  if (partial->channels == 2) {
+    const uint32_t *words = (const uint32_t *) partial->data;
+    uint64_t i = 0;
+    for (; i + 2 <= partial->samples; i += 2) {
+      uint32_t a = words[i];
+      uint32_t b = words[i + 1];
+      histograms[0][0][a & 0x03ff]++;
+      histograms[1][0][(a >> 16) & 0x03ff]++;
+      histograms[0][1][b & 0x03ff]++;
+      histograms[1][1][(b >> 16) & 0x03ff]++;
+    }
+    for (; i < partial->samples; i++) {
+      histograms[0][0][words[i] & 0x03ff]++;
+      histograms[1][0][(words[i] >> 16) & 0x03ff]++;
+    }
+  } else {
+    const uint16_t *samples = (const uint16_t *) partial->data;
+    uint64_t i = 0;
+    for (; i + 2 <= partial->samples; i += 2) {
+      histograms[0][0][samples[i] & 0x03ff]++;
+      histograms[0][1][samples[i + 1] & 0x03ff]++;
+    }
+    for (; i < partial->samples; i++) {
+      histograms[0][0][samples[i] & 0x03ff]++;
+    }
+  }
+  for (int c = 0; c < 2; c++) {
+    for (int code = 0; code < CODES; code++) {
+      partial->histogram[c][code] = histograms[c][0][code] +
+                                    histograms[c][1][code];
+    }
+  }
+
+  int n = partial->fft.fft_size;
+  if (n == 0) return NULL;
+  uint64_t blocks = partial->samples / n;
+  uint64_t step = 1;
+  if (partial->fft.max_blocks && blocks > (uint64_t) partial->fft.max_blocks) {
+    step = blocks / partial->fft.max_blocks;
+  }
+  float *z = (float *) malloc(2 * n * sizeof(float));
+  if (!z) {
+    fprintf(stderr, "Couldn't allocate memory.\n");
+    return NULL;
+  }
+  for (uint64_t block = 0; block < blocks; block += step) {
+    accumulate_spectrum(partial, z, block * n);
+  }
+  free(z);
+  return NULL;
+}
+
+// Fills in DNL and INL (in LSBs) for every code from the histogram, using
+// the cumulative histogram to find each code's transition levels.  Codes
+// outside the range of the input (and the end codes, which soak up
+// everything beyond it) are left at 0.
+void linearity(const uint64_t *histogram, model_t model, int min, int max,
+               double *dnl, double *inl) {
+  memset(dnl, 0, CODES * sizeof(*dnl));
+  memset(inl, 0, CODES * sizeof(*inl));
+  if (max - min < 3) return;
+
+  uint64_t total = 0;
+  for (int code = min; code <= max; code++) {
+    total += histogram[code];
+  }
+
+  // transitions[k] is the input level (on an arbitrary scale) where the
+  // output goes from code k - 1 to code k.
+  double transitions[CODES + 1];
+  uint64_t below = histogram[min];
+  for (int code = min + 1; code <= max; code++) {
+    double fraction = (double) below / total;
+    transitions[code] = model == MODEL_SINE ? -cos(M_PI * fraction) : fraction;
+    below += histogram[code];
+  }
+
+  // Widths of the codes strictly between the end codes
+  double average = (transitions[max] - transitions[min + 1]) / (max - min - 1);
+  double sum = 0;
+  for (int code = min + 1; code < max; code++) {
+    dnl[code] = (transitions[code + 1] - transitions[code]) / average - 1;
+    sum += dnl[code];
+    inl[code] = sum;
+  }
+}
+
+// Reduces the merged spectrum to SNR, SINAD and ENOB, treating the biggest
+// non-DC bin as the tone and its first few harmonics as distortion.
+void tone_quality(const double *spectrum, int n, channel_result_t *result) {
+  // Bins on either side of a peak that hold its leakage through the window
+  const int spread = 4;
+  int bins = n / 2 + 1;
+
+  int peak = spread + 1;
+  for (int k = spread + 1; k < bins; k++) {
+    if (spectrum[k] > spectrum[peak]) {
+      peak = k;
+    }
+  }
+  result->peak_bin = peak;
+
+  // Mark which bins belong to DC, the tone, and its harmonics 2-6, folding
+  // harmonics above Nyquist back down.
+  char kind[bins];
+  memset(kind, 'n', bins);
+  for (int k = 0; k <= spread && k < bins; k++) kind[k] = 'd';
+  for (int harmonic = 1; harmonic <= 6; harmonic++) {
+    int bin = (int) (((int64_t) harmonic * peak) % n);
+    if (bin > n / 2) bin = n - bin;
+    for (int k = bin - spread; k <= bin + spread; k++) {
+      if (k >= 0 && k < bins && kind[k] != 'd' && kind[k] != 's') {
+        kind[k] = harmonic == 1 ? 's' : 'h';
+      }
+    }
+  }
+
+  double signal = 0, distortion = 0, noise = 0;
+  int noise_bins = 0;
+  for (int k = 0; k < bins; k++) {
+    switch (kind[k]) {
+      case 's': signal += spectrum[k]; break;
+      case 'h': distortion += spectrum[k]; break;
+      case 'n': noise += spectrum[k]; noise_bins++; break;
+    }
+  }
+  // Fill in the noise hiding under DC, the tone and the harmonics
+  if (noise_bins > 0) {
+    noise *= (double) bins / noise_bins;
+  }
+
+  result->snr = 10 * log10(signal / noise);
+  result->sinad = 10 * log10(signal / (noise + distortion));
+  result->enob = (result->sinad - 1.76) / 6.02;
+}
+
+void summarize(const uint64_t *histogram, channel_result_t *result) {
+  uint64_t count = 0;
+  double sum = 0, sum_squares = 0;
+  result->min = CODES;
+  result->max = -1;
+  result->codes_hit = 0;
+  for (int code = 0; code < CODES; code++) {
+    uint64_t n = histogram[code];
+    if (n == 0) continue;
+    if (code < result->min) result->min = code;
+    if (code > result->max) result->max = code;
+    result->codes_hit++;
+    count += n;
+    sum += (double) n * code;
+    sum_squares += (double) n * code * code;
+  }
+  if (count == 0) {
+    result->mean = result->rms = result->ac_rms = 0;
+    return;
+  }
+  result->mean = sum / count;
+  result->rms = sqrt(sum_squares / count);
+  double variance = sum_squares / count - result->mean * result->mean;
+  result->ac_rms = variance > 0 ? sqrt(variance) : 0;
+}
+
+double elapsed(struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main (int argc, char **argv) {
+  int ch = -1;
+  layout_t layout = LAYOUT_INTERLEAVED;
+  model_t model = MODEL_SINE;
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  fft_options_t fft_options = { 8192, 256 };
+  double rate = 0;
+  char* histogram_fname = NULL;
+
+  // Process command line flags
+  while (-1 != (ch = getopt(argc, argv, "l:t:n:ad:r:H:"))) {
+    switch (ch) {
+    case 'l':
+      if (0 == strcmp(optarg, "interleaved")) {
+        layout = LAYOUT_INTERLEAVED;
+      } else if (0 == strcmp(optarg, "single")) {
+        layout = LAYOUT_SINGLE;
+      } else {
+        fprintf(stderr, "\nUnknown layout %s\n", optarg);
+        usage(argv[0]);
+      }
+      break;
+    case 't':
+      threads = strtol(optarg, NULL, 0);
+      if (threads < 1) {
+        fprintf(stderr, "\n-t value must be at least 1\n");
+        usage(argv[0]);
+      }
+      break;
+    case 'n':
+      fft_options.fft_size = strtol(optarg, NULL, 0);
+      if (fft_options.fft_size < 0 || fft_options.fft_size == 1 ||
+          (fft_options.fft_size & (fft_options.fft_size - 1))) {
+        fprintf(stderr, "\n-n value must be a power of 2, or 0\n");
+        usage(argv[0]);
+      }
+      break;
+    case 'a':
+      fft_options.max_blocks = 0;
+      break;
+    case 'd':
+      if (0 == strcmp(optarg, "sine")) {
+        model = MODEL_SINE;
+      } else if (0 == strcmp(optarg, "ramp")) {
+        model = MODEL_RAMP;
+      } else {
+        fprintf(stderr, "\nUnknown model %s\n", optarg);
+        usage(argv[0]);
+      }
+      break;
+    case 'r':
+      rate = strtod(optarg, NULL);
+      break;
+    case 'H':
+      histogram_fname = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      break;
+    }
+  }
+
+  if (argc - optind != 1) {
+    usage(argv[0]);
+  }
+
+  int fd = open(argv[optind], O_RDONLY);
+  struct stat st;
+  if (fd < 0 || 0 != fstat(fd, &st)) {
+    perror("unable to open capture file");
+    return EXIT_FAILURE;
+  }
+
+  int channels = layout == LAYOUT_INTERLEAVED ? 2 : 1;
+  size_t sample_bytes = layout == LAYOUT_INTERLEAVED ? sizeof(uint32_t)
+                                                     : sizeof(uint16_t);
+  uint64_t samples = st.st_size / sample_bytes;
+  if (samples == 0) {
+    fprintf(stderr, "%s has no samples\n", argv[optind]);
+    return EXIT_FAILURE;
+  }
+
+  const uint8_t *data = (const uint8_t *) mmap(NULL, st.st_size, PROT_READ,
+                                               MAP_SHARED, fd, 0);
+  if (MAP_FAILED == data) {
+    perror("unable to map capture file");
+    return EXIT_FAILURE;
+  }
+  madvise((void *) data, st.st_size, MADV_SEQUENTIAL | MADV_WILLNEED);
+
+  if (fft_options.fft_size > 0 && samples < (uint64_t) fft_options.fft_size) {
+    fprintf(stderr, "Capture is shorter than one FFT block, so skipping"
+            " the spectrum\n");
+    fft_options.fft_size = 0;
+  }
+  // Keep every thread's share of the spectrum blocks whole
+  uint64_t granule = fft_options.fft_size ? fft_options.fft_size : 1;
+  uint64_t per_thread = (samples + threads - 1) / threads;
+  per_thread = (per_thread + granule - 1) / granule * granule;
+
+  float *twiddles = NULL;
+  float *window = NULL;
+  if (fft_options.fft_size) {
+    twiddles = make_twiddles(fft_options.fft_size);
+    window = make_window(fft_options.fft_size);
+  }
+  partial_t *partials = (partial_t *) calloc(threads, sizeof(partial_t));
+  pthread_t *thread_ids = (pthread_t *) calloc(threads, sizeof(pthread_t));
+  if (!partials || !thread_ids ||
+      (fft_options.fft_size && (!twiddles || !window))) {
+    fprintf(stderr, "Couldn't allocate memory.\n");
+    return EXIT_FAILURE;
+  }
+
+  struct timespec start_time;
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+  int started = 0;
+  for (int t = 0; t < threads; t++) {
+    uint64_t first = t * per_thread;
+    if (first >= samples) break;
+    partial_t *partial = &(partials[t]);
+    partial->data = data + first * sample_bytes;
+    partial->samples = samples - first < per_thread ? samples - first
+                                                    : per_thread;
+    partial->channels = channels;
+    partial->fft = fft_options;
+    if (fft_options.max_blocks) {
+      // Split the block budget among the threads
+      partial->fft.max_blocks = (fft_options.max_blocks + threads - 1) / threads;
+    }
+    partial->window = window;
+    partial->twiddles = twiddles;
+    for (int c = 0; c < channels && fft_options.fft_size; c++) {
+      partial->spectrum[c] = (double *) calloc(fft_options.fft_size / 2 + 1,
+                                               sizeof(double));
+      if (!partial->spectrum[c]) {
+        fprintf(stderr, "Couldn't allocate memory.\n");
+        return EXIT_FAILURE;
+      }
+    }
+    if (0 != pthread_create(&(thread_ids[t]), NULL, analyze_thread, partial)) {
+      perror("unable to start thread");
+      return EXIT_FAILURE;
+    }
+    started++;
+  }
+
+  // Merge everything into the first thread's results
+  partial_t *total = &(partials[0]);
+  for (int t = 0; t < started; t++) {
+    pthread_join(thread_ids[t], NULL);
+    if (t == 0) continue;
+    for (int c = 0; c < channels; c++) {
+      for (int code = 0; code < CODES; code++) {
+        total->histogram[c][code] += partials[t].histogram[c][code];
+      }
+      for (int k = 0; fft_options.fft_size && k <= fft_options.fft_size / 2; k++) {
+        total->spectrum[c][k] += partials[t].spectrum[c][k];
+      }
+    }
+    total->blocks += partials[t].blocks;
+  }
+
+  double seconds = elapsed(&start_time);
+  fprintf(stderr, "Analyzed %.2fGB in %.2fs (%.2fGB/s) with %d threads\n",
+          st.st_size / 1e9, seconds, st.st_size / 1e9 / seconds, started);
+
+  FILE *fhistogram = NULL;
+  if (histogram_fname) {
+    fhistogram = fopen(histogram_fname, "w");
+    if (NULL == fhistogram) {
+      perror("unable to open histogram file");
+      return EXIT_FAILURE;
+    }
+    fprintf(fhistogram, "# channel code count dnl inl\n");
+  }
+
+  printf("%" PRIu64 " samples per channel\n", samples);
+  for (int c = 0; c < channels; c++) {
+    channel_result_t result;
+    summarize(total->histogram[c], &result);
+
+    static double dnl[CODES], inl[CODES];
+    linearity(total->histogram[c], model, result.min, result.max, dnl, inl);
+    result.dnl_min = result.dnl_max = result.inl_min = result.inl_max = 0;
+    for (int code = 0; code < CODES; code++) {
+      if (dnl[code] < result.dnl_min) result.dnl_min = dnl[code];
+      if (dnl[code] > result.dnl_max) result.dnl_max = dnl[code];
+      if (inl[code] < result.inl_min) result.inl_min = inl[code];
+      if (inl[code] > result.inl_max) result.inl_max = inl[code];
+      if (fhistogram) {
+        fprintf(fhistogram, "%d %d %" PRIu64 " %.4f %.4f\n", c, code,
+                total->histogram[c][code], dnl[code], inl[code]);
+      }
+    }
+
+    printf("channel %d:\n", c);
+    printf("  min %d  max %d  mean %.3f  rms %.3f  ac rms %.3f codes\n",
+           result.min, result.max, result.mean, result.rms, result.ac_rms);
+    printf("  %d of %d codes hit.  DNL %+.3f/%+.3f LSB, INL %+.3f/%+.3f LSB"
+           " (%s model)\n",
+           result.codes_hit, CODES, result.dnl_min, result.dnl_max,
+           result.inl_min, result.inl_max,
+           model == MODEL_SINE ? "sine" : "ramp");
+
+    if (fft_options.fft_size && total->blocks) {
+      tone_quality(total->spectrum[c], fft_options.fft_size, &result);
+      double tone = (double) result.peak_bin / fft_options.fft_size;
+      printf("  tone at %.5f fs", tone);
+      if (rate > 0) {
+        printf(" (%.1fHz)", tone * rate);
+      }
+      printf(".  SNR %.2fdB  SINAD %.2fdB  ENOB %.2f bits"
+             " (%" PRIu64 " blocks of %d)\n",
+             result.snr, result.sinad, result.enob, total->blocks,
+             fft_options.fft_size);
+    }
+  }
+
+  if (fhistogram) {
+    fclose(fhistogram);
+  }
+  munmap((void *) data, st.st_size);
+  close(fd);
+  return 0;
+}
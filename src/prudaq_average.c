@@ -0,0 +1,332 @@
+/*
+Copyright 2015 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied.  See the License for the specific language governing
+permissions and limitations under the License.
+*/
+
+/*
+Triggered averaging.  See prudaq_average.h.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
+#include "prudaq_average.h"
+
+// Squares of 10-bit samples fit 4104 times in 32 bits, so the 32-bit
+// accumulators are folded into the 64-bit totals this often.
+#define FOLD_RECORDS 4096
+
+// Bit 10 of channel 0 holds the input select state
+#define SELECT_BIT (1 << 10)
+
+struct prudaq_averager {
+  prudaq_trigger_t trigger;
+  uint32_t length;
+  uint32_t records;
+  int variance;
+  FILE *out;
+
+  // Whether a level trigger has seen the signal on the far side of the
+  // level, and the select state of the last sample, for select triggers
+  int armed;
+  int seen_select;
+  uint32_t last_select;
+
+  // Whether we're in a record (rather than waiting for a trigger), and if
+  // so how much of it we have.  A record that arrives across several
+  // prudaq_averager_add() calls is kept in partial until it's complete, so
+  // that it can still be discarded.
+  int recording;
+  uint32_t filled;
+  uint32_t *partial;
+  // Records since the last average was written, and since the last fold
+  uint32_t done;
+  uint32_t since_fold;
+
+  // Both channels interleaved, like the words they come from
+  uint32_t *sums;
+  uint32_t *squares;
+  uint64_t *total_sums;
+  uint64_t *total_squares;
+  float *record;
+  uint64_t averages;
+};
+
+int prudaq_trigger_parse(const char *spec, prudaq_trigger_t *trigger) {
+  trigger->channel = 0;
+  trigger->hysteresis = PRUDAQ_TRIGGER_HYSTERESIS;
+  if (0 == strncmp(spec, "select", 6)) {
+    trigger->kind = PRUDAQ_TRIGGER_SELECT;
+    if (0 == strcmp(&(spec[6]), "")) {
+      trigger->level = -1;
+    } else if (0 == strcmp(&(spec[6]), "+")) {
+      trigger->level = 1;
+    } else if (0 == strcmp(&(spec[6]), "-")) {
+      trigger->level = 0;
+    } else {
+      return -1;
+    }
+    return 0;
+  }
+
+  if ((spec[0] != '0' && spec[0] != '1') ||
+      (spec[1] != '+' && spec[1] != '-')) {
+    return -1;
+  }
+  char *end = NULL;
+  trigger->channel = spec[0] - '0';
+  trigger->kind = spec[1] == '+' ? PRUDAQ_TRIGGER_RISING
+                                 : PRUDAQ_TRIGGER_FALLING;
+  trigger->level = strtol(&(spec[2]), &end, 0);
+  if (end == &(spec[2]) || trigger->level < 0 || trigger->level > 1023) {
+    return -1;
+  }
+  if (*end == '/') {
+    char *hysteresis = end + 1;
+    trigger->hysteresis = strtol(hysteresis, &end, 0);
+    if (end == hysteresis || trigger->hysteresis < 1) {
+      return -1;
+    }
+  }
+  return *end ? -1 : 0;
+}
+
+prudaq_averager_t *prudaq_averager_create(const prudaq_trigger_t *trigger,
+                                          uint32_t length, uint32_t records,
+                                          int variance, FILE *out) {
+  if (length < 1 || records < 1) {
+    fprintf(stderr, "Records need at least one sample, and at least one of"
+            " them to average\n");
+    return NULL;
+  }
+
+  prudaq_averager_t *averager =
+      (prudaq_averager_t *) calloc(1, sizeof(*averager));
+  if (!averager) {
+    fprintf(stderr, "Couldn't allocate memory.\n");
+    return NULL;
+  }
+  averager->trigger = *trigger;
+  averager->length = length;
+  averager->records = records;
+  averager->variance = variance;
+  averager->out = out;
+
+  // Everything is allocated up front, so nothing is allocated per record
+  averager->sums = (uint32_t *) calloc(2 * length, sizeof(uint32_t));
+  averager->squares = (uint32_t *) calloc(2 * length, sizeof(uint32_t));
+  averager->total_sums = (uint64_t *) calloc(2 * length, sizeof(uint64_t));
+  averager->total_squares = (uint64_t *) calloc(2 * length, sizeof(uint64_t));
+  averager->record = (float *) calloc(4 * length, sizeof(float));
+  averager->partial = (uint32_t *) calloc(length, sizeof(uint32_t));
+  if (!averager->sums || !averager->squares || !averager->total_sums ||
+      !averager->total_squares || !averager->record || !averager->partial) {
+    fprintf(stderr, "Couldn't allocate memory.\n");
+    prudaq_averager_destroy(averager);
+    return NULL;
+  }
+  return averager;
+}
+
+void prudaq_averager_destroy(prudaq_averager_t *averager) {
+  free(averager->sums);
+  free(averager->squares);
+  free(averager->total_sums);
+  free(averager->total_squares);
+  free(averager->record);
+  free(averager->partial);
+  free(averager);
+}
+
+void prudaq_averager_discard(prudaq_averager_t *averager) {
+  averager->recording = 0;
+  averager->filled = 0;
+  // Level triggers have to see the signal cross again, and select triggers
+  // start over from the state of the next word, so that the break itself
+  // doesn't look like a trigger.
+  averager->armed = 0;
+  averager->seen_select = 0;
+}
+
+uint64_t prudaq_averager_averages(const prudaq_averager_t *averager) {
+  return averager->averages;
+}
+
+// Adds count words to the accumulators starting at sums and squares.
+static void accumulate(const uint32_t *words, uint32_t *sums,
+                       uint32_t *squares, uint32_t count, int variance) {
+  uint32_t i = 0;
+#ifdef __ARM_NEON__
+  // Viewed as 16-bit lanes, 4 words are already in the same interleaved
+  // order as the accumulators, so each half widens straight into 4 sums.
+  const uint16x8_t mask = vdupq_n_u16(0x03ff);
+  for (; i + 4 <= count; i += 4) {
+    uint16x8_t x = vandq_u16(vld1q_u16((const uint16_t *) &(words[i])), mask);
+    uint32_t *s = &(sums[2 * i]);
+    vst1q_u32(s, vaddw_u16(vld1q_u32(s), vget_low_u16(x)));
+    vst1q_u32(s + 4, vaddw_u16(vld1q_u32(s + 4), vget_high_u16(x)));
+    if (variance) {
+      uint32_t *q = &(squares[2 * i]);
+      vst1q_u32(q, vmlal_u16(vld1q_u32(q), vget_low_u16(x), vget_low_u16(x)));
+      vst1q_u32(q + 4, vmlal_u16(vld1q_u32(q + 4), vget_high_u16(x),
+                                 vget_high_u16(x)));
+    }
+  }
+#endif
+  for (; i < count; i++) {
+    uint32_t ch0 = words[i] & 0x03ff;
+    uint32_t ch1 = (words[i] >> 16) & 0x03ff;
+    sums[2 * i] += ch0;
+    sums[2 * i + 1] += ch1;
+    if (variance) {
+      squares[2 * i] += ch0 * ch0;
+      squares[2 * i + 1] += ch1 * ch1;
+    }
+  }
+}
+
+static void fold(prudaq_averager_t *averager) {
+  for (uint32_t i = 0; i < 2 * averager->length; i++) {
+    averager->total_sums[i] += averager->sums[i];
+    averager->total_squares[i] += averager->squares[i];
+  }
+  memset(averager->sums, 0, 2 * averager->length * sizeof(uint32_t));
+  memset(averager->squares, 0, 2 * averager->length * sizeof(uint32_t));
+  averager->since_fold = 0;
+}
+
+static int emit(prudaq_averager_t *averager) {
+  fold(averager);
+
+  int per_sample = averager->variance ? 4 : 2;
+  double n = averager->records;
+  for (uint32_t i = 0; i < averager->length; i++) {
+    for (int c = 0; c < 2; c++) {
+      double mean = averager->total_sums[2 * i + c] / n;
+      averager->record[per_sample * i + c] = mean;
+      if (averager->variance) {
+        double variance = averager->total_squares[2 * i + c] / n - mean * mean;
+        averager->record[per_sample * i + 2 + c] = variance > 0 ? variance : 0;
+      }
+    }
+  }
+  memset(averager->total_sums, 0, 2 * averager->length * sizeof(uint64_t));
+  memset(averager->total_squares, 0, 2 * averager->length * sizeof(uint64_t));
+  averager->done = 0;
+  averager->averages++;
+
+  size_t values = per_sample * averager->length;
+  if (values != fwrite(averager->record, sizeof(float), values,
+                       averager->out)) {
+    perror("unable to write averages");
+    return -1;
+  }
+  return 0;
+}
+
+// Returns the index of the first word in words[0..count) that triggers,
+// or count if none do.
+static uint32_t find_trigger(prudaq_averager_t *averager,
+                             const uint32_t *words, uint32_t count) {
+  const prudaq_trigger_t *trigger = &(averager->trigger);
+  if (trigger->kind == PRUDAQ_TRIGGER_SELECT) {
+    // Only the direction asked for fires, but every change counts
+    // as the new state to compare against.
+    uint32_t wanted = trigger->level == 1 ? SELECT_BIT : 0;
+    for (uint32_t i = 0; i < count; i++) {
+      uint32_t select = words[i] & SELECT_BIT;
+      if (select != averager->last_select) {
+        averager->last_select = select;
+        if (trigger->level < 0 || select == wanted) {
+          return i;
+        }
+      }
+    }
+    return count;
+  }
+
+  // Rising and falling are the same test with the samples flipped over
+  int shift = trigger->channel * 16;
+  int flip = trigger->kind == PRUDAQ_TRIGGER_FALLING ? 0x03ff : 0;
+  int level = trigger->level ^ flip;
+  int arm_below = level - trigger->hysteresis;
+  for (uint32_t i = 0; i < count; i++) {
+    int sample = ((words[i] >> shift) & 0x03ff) ^ flip;
+    if (!averager->armed) {
+      averager->armed = sample < arm_below;
+    } else if (sample >= level) {
+      averager->armed = 0;
+      return i;
+    }
+  }
+  return count;
+}
+
+int prudaq_averager_add(prudaq_averager_t *averager, const uint32_t *words,
+                        uint32_t count) {
+  // Select triggers fire on changes, so start from whatever the state is
+  if (!averager->seen_select && count > 0) {
+    averager->last_select = words[0] & SELECT_BIT;
+    averager->seen_select = 1;
+  }
+
+  while (count > 0) {
+    if (!averager->recording) {
+      uint32_t at = find_trigger(averager, words, count);
+      words += at;
+      count -= at;
+      if (count == 0) break;
+      averager->recording = 1;
+      averager->filled = 0;
+    }
+
+    // Whole records go straight into the accumulators, and pieces of one
+    // wait in partial for the rest
+    uint32_t n = averager->length - averager->filled;
+    if (n > count) n = count;
+    if (averager->filled == 0 && n == averager->length) {
+      accumulate(words, averager->sums, averager->squares, n,
+                 averager->variance);
+    } else {
+      memcpy(&(averager->partial[averager->filled]), words,
+             n * sizeof(uint32_t));
+      if (averager->filled + n == averager->length) {
+        accumulate(averager->partial, averager->sums, averager->squares,
+                   averager->length, averager->variance);
+      }
+    }
+    averager->filled += n;
+    words += n;
+    count -= n;
+    if (averager->filled < averager->length) break;
+
+    // Finished a record.  Select triggers pick up from its last sample, so
+    // that an edge in the middle of it doesn't count.
+    averager->recording = 0;
+    averager->last_select = words[-1] & SELECT_BIT;
+    averager->done++;
+    if (++averager->since_fold == FOLD_RECORDS) {
+      fold(averager);
+    }
+    if (averager->done == averager->records && 0 != emit(averager)) {
+      return -1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,91 @@
+/*
+Copyright 2015 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied.  See the License for the specific language governing
+permissions and limitations under the License.
+*/
+
+/*
+Triggered (coherent) averaging: for repetitive signals, wait for a trigger,
+add the next length samples of each channel to a running sum, and after
+records triggers write out the average record.  Noise that isn't locked to
+the trigger averages away, improving SNR by sqrt(records) while writing
+records times less data.
+
+prudaq_capture -a uses this.  It doesn't touch the hardware, so it works
+on captured words too.
+*/
+
+#ifndef PRUDAQ_AVERAGE_H
+#define PRUDAQ_AVERAGE_H
+
+#include <stdio.h>
+#include <inttypes.h>
+
+typedef enum {
+  // A change in the input select state recorded in bit 10 of each word
+  PRUDAQ_TRIGGER_SELECT,
+  // The channel going from below level to level or above
+  PRUDAQ_TRIGGER_RISING,
+  // The channel going from above level to level or below
+  PRUDAQ_TRIGGER_FALLING,
+} prudaq_trigger_kind_t;
+
+typedef struct {
+  prudaq_trigger_kind_t kind;
+  int channel;
+  // For select triggers, 1 for 0 to 1 changes, 0 for 1 to 0 changes and -1
+  // for both.  For the others, the level in codes.
+  int level;
+  // Level triggers need to see the signal this many codes on the far side
+  // of the level before they fire again, so that noise around the level
+  // doesn't retrigger them.
+  int hysteresis;
+} prudaq_trigger_t;
+
+#define PRUDAQ_TRIGGER_HYSTERESIS 4
+
+typedef struct prudaq_averager prudaq_averager_t;
+
+// Parses a trigger spec, which is either "select" for any change of input
+// select state ("select+" or "select-" for just one direction), or a
+// channel, + (rising) or - (falling), a level and optionally / and the
+// hysteresis (default: PRUDAQ_TRIGGER_HYSTERESIS), e.g. "0+512" or
+// "1-300/20".  Returns -1 if spec isn't one of those.
+int prudaq_trigger_parse(const char *spec, prudaq_trigger_t *trigger);
+
+// Sets up averaging records records of length samples each, written to out
+// as float32s: for each sample, the mean of channel 0 and channel 1, then
+// if variance is set, their variances.  Returns NULL (after explaining why
+// on stderr) on failure.
+prudaq_averager_t *prudaq_averager_create(const prudaq_trigger_t *trigger,
+                                          uint32_t length, uint32_t records,
+                                          int variance, FILE *out);
+
+// Looks for triggers in count raw sample words and accumulates the records
+// that follow them, writing out each finished average.  Returns -1 if the
+// output couldn't be written.
+int prudaq_averager_add(prudaq_averager_t *averager, const uint32_t *words,
+                        uint32_t count);
+
+// Drops the record in progress, if any, and waits for a fresh trigger, as
+// though the words added so far had been followed by a break in the
+// signal.  Call it when samples have been lost or the sample rate has
+// changed, so that a record never straddles the two.
+void prudaq_averager_discard(prudaq_averager_t *averager);
+
+// Number of averages written so far
+uint64_t prudaq_averager_averages(const prudaq_averager_t *averager);
+
+void prudaq_averager_destroy(prudaq_averager_t *averager);
+
+#endif
@@ -0,0 +1,243 @@
+/*
+Copyright 2015 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied.  See the License for the specific language governing
+permissions and limitations under the License.
+*/
+
+/*
+Loads, saves and applies the calibration profiles described in
+prudaq_calibration.h.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "prudaq_calibration.h"
+
+#define INPUTS 8
+#define CODES 1024
+
+struct prudaq_calibration {
+  prudaq_calibrated_format_t format;
+  double offset[INPUTS];
+  double gain[INPUTS];
+  int has_linear[INPUTS];
+  float linear[INPUTS][CODES];
+
+  // What each input's codes calibrate to, in the output format
+  int16_t s16[INPUTS][CODES];
+  float f[INPUTS][CODES];
+};
+
+// Refolds an input's offset, gain and linearity table into its output table
+static void build_table(prudaq_calibration_t *calibration, int input) {
+  for (int code = 0; code < CODES; code++) {
+    double value = (prudaq_calibration_linear(calibration, input, code) -
+                    calibration->offset[input]) * calibration->gain[input];
+    if (calibration->format == PRUDAQ_CALIBRATED_FLOAT) {
+      calibration->f[input][code] = value;
+      continue;
+    }
+    double scaled = round(value * PRUDAQ_CALIBRATED_SCALE);
+    if (scaled > INT16_MAX) scaled = INT16_MAX;
+    if (scaled < INT16_MIN) scaled = INT16_MIN;
+    calibration->s16[input][code] = scaled;
+  }
+}
+
+prudaq_calibration_t *prudaq_calibration_create(
+    prudaq_calibrated_format_t format) {
+  prudaq_calibration_t *calibration =
+    (prudaq_calibration_t *) calloc(1, sizeof(*calibration));
+  if (!calibration) {
+    fprintf(stderr, "Couldn't allocate memory.\n");
+    return NULL;
+  }
+  calibration->format = format;
+  for (int input = 0; input < INPUTS; input++) {
+    calibration->gain[input] = 1;
+    build_table(calibration, input);
+  }
+  return calibration;
+}
+
+prudaq_calibration_t *prudaq_calibration_load(
+    const char *path, prudaq_calibrated_format_t format) {
+  FILE *in = fopen(path, "r");
+  if (!in) {
+    perror("unable to open calibration profile");
+    return NULL;
+  }
+  prudaq_calibration_t *calibration = prudaq_calibration_create(format);
+  if (!calibration) {
+    fclose(in);
+    return NULL;
+  }
+
+  // Linearity table lines run to around 10KB, so let getline() size the
+  // buffer.
+  char *line = NULL;
+  size_t line_len = 0;
+  int line_number = 0;
+  int failed = 0;
+  while (!failed && -1 != getline(&line, &line_len, in)) {
+    line_number++;
+    char *p = line + strspn(line, " \t");
+    if (*p == '#' || *p == '\n' || *p == '\0') continue;
+
+    int input;
+    int used;
+    if (1 == sscanf(p, "lut %d%n", &input, &used) &&
+        input >= 0 && input < INPUTS) {
+      p += used;
+      for (int code = 0; code < CODES; code++) {
+        char *end;
+        calibration->linear[input][code] = strtod(p, &end);
+        if (end == p) {
+          failed = 1;
+          break;
+        }
+        p = end;
+      }
+      calibration->has_linear[input] = 1;
+    } else {
+      double offset, gain;
+      if (3 != sscanf(p, "%d %lf %lf", &input, &offset, &gain) ||
+          input < 0 || input >= INPUTS) {
+        failed = 1;
+        break;
+      }
+      calibration->offset[input] = offset;
+      calibration->gain[input] = gain;
+    }
+  }
+  free(line);
+  fclose(in);
+
+  if (failed) {
+    fprintf(stderr, "%s:%d: expected \"input offset gain\" or \"lut input\""
+            " and %d values, with inputs 0-%d\n", path, line_number, CODES,
+            INPUTS - 1);
+    free(calibration);
+    return NULL;
+  }
+  for (int input = 0; input < INPUTS; input++) {
+    build_table(calibration, input);
+  }
+  return calibration;
+}
+
+int prudaq_calibration_save(const prudaq_calibration_t *calibration,
+                            const char *path) {
+  FILE *out = fopen(path, "w");
+  if (!out) {
+    perror("unable to open calibration profile");
+    return -1;
+  }
+  fprintf(out, "# input offset gain\n");
+  for (int input = 0; input < INPUTS; input++) {
+    fprintf(out, "%d %.6f %.8f\n", input, calibration->offset[input],
+            calibration->gain[input]);
+  }
+  for (int input = 0; input < INPUTS; input++) {
+    if (!calibration->has_linear[input]) continue;
+    fprintf(out, "lut %d", input);
+    for (int code = 0; code < CODES; code++) {
+      fprintf(out, " %.4f", calibration->linear[input][code]);
+    }
+    fprintf(out, "\n");
+  }
+  if (0 != fclose(out)) {
+    perror("couldn't write calibration profile");
+    return -1;
+  }
+  return 0;
+}
+
+void prudaq_calibration_destroy(prudaq_calibration_t *calibration) {
+  free(calibration);
+}
+
+void prudaq_calibration_set(prudaq_calibration_t *calibration, int input,
+                            double offset, double gain) {
+  calibration->offset[input] = offset;
+  calibration->gain[input] = gain;
+  build_table(calibration, input);
+}
+
+double prudaq_calibration_linear(const prudaq_calibration_t *calibration,
+                                 int input, uint32_t code) {
+  return calibration->has_linear[input] ?
+         calibration->linear[input][code] : code;
+}
+
+int prudaq_calibration_fit(prudaq_calibration_t *calibration, int input,
+                           double low, double low_ref,
+                           double high, double high_ref) {
+  // Less than a code apart means the input isn't following the references
+  if (fabs(high - low) < 1 || high_ref == low_ref) {
+    return -1;
+  }
+  double gain = (high_ref - low_ref) / (high - low);
+  prudaq_calibration_set(calibration, input, low - low_ref / gain, gain);
+  return 0;
+}
+
+uint32_t prudaq_calibration_sample_size(
+    const prudaq_calibration_t *calibration) {
+  return calibration->format == PRUDAQ_CALIBRATED_FLOAT ?
+         sizeof(float) : sizeof(int16_t);
+}
+
+// The lookups don't vectorize, but they replace the mask rather than adding
+// a pass, and which channels to write is decided once per call rather than
+// once per sample.
+#define DEFINE_CALIBRATE(name, type)                                         \
+  static void name(const type *table0, const type *table1,                   \
+                   const uint32_t *words, type *out0, type *out1,            \
+                   uint32_t stride, uint32_t count) {                        \
+    if (out0 && out1) {                                                      \
+      for (uint32_t i = 0; i < count; i++) {                                 \
+        out0[i * stride] = table0[words[i] & 0x03ff];                        \
+        out1[i * stride] = table1[(words[i] >> 16) & 0x03ff];                \
+      }                                                                      \
+    } else if (out0) {                                                       \
+      for (uint32_t i = 0; i < count; i++) {                                 \
+        out0[i * stride] = table0[words[i] & 0x03ff];                        \
+      }                                                                      \
+    } else if (out1) {                                                       \
+      for (uint32_t i = 0; i < count; i++) {                                 \
+        out1[i * stride] = table1[(words[i] >> 16) & 0x03ff];                \
+      }                                                                      \
+    }                                                                        \
+  }
+
+DEFINE_CALIBRATE(calibrate_s16, int16_t)
+DEFINE_CALIBRATE(calibrate_float, float)
+
+void prudaq_calibrate(const prudaq_calibration_t *calibration,
+                      int channel0_input, int channel1_input,
+                      const uint32_t *words, void *channel0, void *channel1,
+                      uint32_t stride, uint32_t count) {
+  if (calibration->format == PRUDAQ_CALIBRATED_FLOAT) {
+    calibrate_float(calibration->f[channel0_input],
+                    calibration->f[channel1_input], words,
+                    (float *) channel0, (float *) channel1, stride, count);
+  } else {
+    calibrate_s16(calibration->s16[channel0_input],
+                  calibration->s16[channel1_input], words,
+                  (int16_t *) channel0, (int16_t *) channel1, stride, count);
+  }
+}
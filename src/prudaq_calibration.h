@@ -0,0 +1,107 @@
+/*
+Copyright 2015 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied.  See the License for the specific language governing
+permissions and limitations under the License.
+*/
+
+/*
+Per-input calibration profiles.  Each of the 8 inputs has an offset, a
+gain and optionally a linearity table, and a raw code from that input
+calibrates to
+
+  (linear[code] - offset) * gain
+
+where linear[code] is the table's entry for the code, or just the code
+when there's no table.  That's in whatever units the profile was fitted
+with; the self test's -c fits it to the reference levels it's given, in
+ideal ADC codes.
+
+Everything is folded into one 1024 entry table per input when the profile
+is loaded or changed, so calibrating a sample costs a table lookup, done
+in the same pass that strips the clock and select bits.
+
+Profiles are text files with a line per input giving the input, offset
+and gain, plus a line for each linearity table giving "lut", the input,
+and the linearized value of each of the 1024 codes.  Lines starting with
+# are comments, and inputs that aren't listed are left uncalibrated:
+
+  # input offset gain
+  0 3.125 1.00412
+  4 -1.5 0.99731
+  lut 4 0.12 1.07 2.01 ...
+*/
+
+#ifndef PRUDAQ_CALIBRATION_H
+#define PRUDAQ_CALIBRATION_H
+
+#include <inttypes.h>
+
+typedef enum {
+  // int16_t samples counting in 1/PRUDAQ_CALIBRATED_SCALE codes, so that
+  // the correction doesn't round away precision
+  PRUDAQ_CALIBRATED_S16,
+  PRUDAQ_CALIBRATED_FLOAT,
+} prudaq_calibrated_format_t;
+
+#define PRUDAQ_CALIBRATED_SCALE 32
+
+typedef struct prudaq_calibration prudaq_calibration_t;
+
+// Returns a profile that leaves every input uncalibrated, or NULL if out of
+// memory.
+prudaq_calibration_t *prudaq_calibration_create(
+    prudaq_calibrated_format_t format);
+
+// Reads a profile from path.  Returns NULL (after explaining why on stderr)
+// on failure.
+prudaq_calibration_t *prudaq_calibration_load(
+    const char *path, prudaq_calibrated_format_t format);
+
+// Writes the profile to path.  Returns -1 (after explaining why on stderr)
+// on failure.
+int prudaq_calibration_save(const prudaq_calibration_t *calibration,
+                            const char *path);
+
+void prudaq_calibration_destroy(prudaq_calibration_t *calibration);
+
+// Replaces an input's offset and gain, keeping its linearity table.
+void prudaq_calibration_set(prudaq_calibration_t *calibration, int input,
+                            double offset, double gain);
+
+// What the input's linearity table makes of code (the code itself if it
+// doesn't have one), for fitting the offset and gain on top of the table.
+double prudaq_calibration_linear(const prudaq_calibration_t *calibration,
+                                 int input, uint32_t code);
+
+// Works out the offset and gain that take the mean linearized readings
+// low and high to the reference levels low_ref and high_ref.  Returns -1 if
+// the readings are too close together to tell.
+int prudaq_calibration_fit(prudaq_calibration_t *calibration, int input,
+                           double low, double low_ref,
+                           double high, double high_ref);
+
+// Bytes per calibrated sample: 2 or 4
+uint32_t prudaq_calibration_sample_size(
+    const prudaq_calibration_t *calibration);
+
+// Masks and calibrates count raw sample words, whose channels were fed by
+// the given inputs.  Channel 0's samples go to channel0[0],
+// channel0[stride], and so on, and likewise for channel 1, so stride is 1
+// for separate planes and 2 with channel1 just after channel0 for
+// interleaved output.  Either may be NULL to skip that channel.
+void prudaq_calibrate(const prudaq_calibration_t *calibration,
+                      int channel0_input, int channel1_input,
+                      const uint32_t *words, void *channel0, void *channel1,
+                      uint32_t stride, uint32_t count);
+
+#endif
@@ -17,7 +17,7 @@ permissions and limitations under the License.
 /*
 Example code for capturing samples from PRUDAQ ADC cape.
 Loads .bin files into both PRUs, then reads from the shared
-buffer in main memory.
+buffer in main memory using libprudaq.
 */
 
 #include <unistd.h>
@@ -26,22 +26,106 @@ buffer in main memory.
 #include <inttypes.h>
 #include <libgen.h>
 #include <string.h>
-
-#include <prussdrv.h>
-#include <pruss_intc_mapping.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 
 #include <signal.h>
 #include <time.h>
 
-// Header for sharing info between PRUs and application processor
-#include "shared_header.h"
+#include "prudaq.h"
+#include "prudaq_pyramid.h"
+#include "prudaq_stage.h"
+#include "prudaq_average.h"
+#include "prudaq_calibration.h"
 
 
 // Used by sig_handler to tell us when to shutdown
 static int bCont = 1;
 
-// The PRUs run at 200MHz
-#define PRU_CLK 200e6
+// How samples are written out (see -l in usage())
+typedef enum {
+  LAYOUT_INTERLEAVED,
+  LAYOUT_CHANNEL0,
+  LAYOUT_CHANNEL1,
+  LAYOUT_PLANAR,
+} layout_t;
+
+typedef struct {
+  layout_t layout;
+  // Where channel 0 and channel 1 samples go, or NULL to drop that channel.
+  // The interleaved layout writes both channels to fout[0].
+  FILE* fout[2];
+  // Space for demuxing each channel into 16-bit samples
+  uint16_t* planes[2];
+  // With -C, samples are calibrated for the inputs feeding each channel
+  // into calibrated instead
+  prudaq_calibration_t* calibration;
+  int inputs[2];
+  uint8_t* calibrated;
+} output_t;
+
+// Most settings changes the drain keeps track of before it has written out
+// the sample each one took effect at.  PRU0 takes a change in one clock
+// cycle and we learn of at most one per drain, so this is plenty; when
+// it's full, drain() leaves the next change with libprudaq until there's
+// room, which also holds back any change waiting behind it.
+#define MAX_PENDING_SWITCHES 4
+
+// Inputs and clock frequency that take over at sample at
+typedef struct {
+  uint64_t at;
+  int inputs[2];
+  double freq;
+} switch_t;
+
+// Everything it takes to move samples from the ring to the output
+typedef struct {
+  prudaq_t *daq;
+  output_t *output;
+  prudaq_pyramid_t *pyramid;
+  prudaq_chain_t *chain;
+  // Takes the place of output with -a
+  prudaq_averager_t *averager;
+  FILE *fmarkers;
+  uint32_t *local_buf;
+  // Most words to copy out and write in one go (see -b)
+  uint32_t block;
+  // When the last time anchor was recorded
+  time_t anchored;
+  // Set whenever the PRUs apply new settings
+  int switched;
+  // Settings changes whose samples haven't been written yet, oldest first,
+  // as a ring starting at switches[switch_head]
+  switch_t switches[MAX_PENDING_SWITCHES];
+  int switch_head;
+  int switch_count;
+  // Clock frequency of the samples being output
+  double freq;
+  // For -A: samples lost, and the most we've found waiting in one pass
+  uint64_t lost;
+  uint32_t max_backlog;
+} drain_t;
+
+// How one -A step went
+typedef struct {
+  uint64_t lost;
+  uint32_t max_backlog;
+  // Fraction of a CPU the drain loop used
+  double cpu;
+} trial_t;
+
+// Where live commands come from (see usage())
+typedef struct {
+  int fd;
+  // Each datagram is a whole command, while stdin needs to be split into lines
+  int is_socket;
+  char buf[256];
+  int len;
+} control_t;
 
 void sig_handler (int sig) {
   // break out of reading loop
@@ -49,6 +133,15 @@ void sig_handler (int sig) {
   return;
 }
 
+// Returns the GPIO clock frequency PRU0 will actually generate for freq.
+double actual_freq(double freq) {
+  uint32_t high_cycles, low_cycles;
+  if (0 != prudaq_clock_cycles(freq, &high_cycles, &low_cycles)) {
+    return 0;
+  }
+  return PRUDAQ_PRU_CLK/((float) (high_cycles + low_cycles));
+}
+
 void usage (char* arg0) {
   fprintf(stderr, "\nUsage: %s [flags] pru0_code.bin pru1_code.bin\n",
           basename(arg0));
@@ -57,11 +150,523 @@ void usage (char* arg0) {
           "  -f freq\t gpio based clock frequency (default: 1000)\n"
           "  -i [0-3]\t channel 0 input select\n"
           "  -q [4-7]\t channel 1 input select\n"
-          "  -o output\t output filename (default: stdout)\n\n"
+          "  -o output\t output filename (default: stdout)\n"
+          "  -l layout\t \"interleaved\" (default) writes 32-bit words holding\n"
+          "\t\t one sample from each channel.  \"0\" or \"1\" writes only that\n"
+          "\t\t channel as 16-bit samples.  \"planar\" writes each channel as\n"
+          "\t\t 16-bit samples to output.0 and output.1\n"
+          "  -c control\t read commands from control while running: \"-\" for\n"
+          "\t\t stdin, or a path at which to create a unix datagram socket.\n"
+          "\t\t Commands are \"f freq\", \"i [0-3]\" and \"q [4-7]\", and several\n"
+          "\t\t can go on one line, e.g. \"i 1 q 5\"\n"
+          "  -m markers\t record sample indices in the markers file, one per line:\n"
+          "\t\t \"S sample input0 input1 freq\" for each settings change,\n"
+          "\t\t \"G sample count\" for samples lost to buffer overruns, and\n"
+          "\t\t \"T sample seconds.nanoseconds\" anchoring a sample to the\n"
+          "\t\t realtime clock about once a second (see prudaq_collect).\n"
+          "\t\t sample counts words from the start of the capture, including\n"
+          "\t\t lost ones.  Markers go in their own file so that the output\n"
+          "\t\t stays plain samples in the -l layout, which prudaq_analyze,\n"
+          "\t\t pipes and other tools read unchanged\n"
+          "  -p pyramid\t build a min/max/mean envelope pyramid of the capture\n"
+          "\t\t in pyramid, pyramid.1, pyramid.2, ... for prudaq_envelope\n"
+          "  -s stage\t run each batch through a processing stage, given as\n"
+          "\t\t stage.so[:args] (see examples/stages).  Can be repeated\n"
+          "\t\t to chain stages together\n"
+          "  -a records:length\t instead of writing every sample, wait for a\n"
+          "\t\t trigger, sum the next length samples, and after every\n"
+          "\t\t records triggers write the average as float32s: channel\n"
+          "\t\t 0 and 1 means for each sample, followed by their\n"
+          "\t\t variances with -V.  Records cut short by an overrun or a\n"
+          "\t\t clock change are dropped\n"
+          "  -t trigger\t for -a: \"select\" (default) for any change in\n"
+          "\t\t input 0 selection, \"select+\" or \"select-\" for one\n"
+          "\t\t direction, or channel, + or -, and level to trigger on a\n"
+          "\t\t rising or falling crossing, e.g. \"0+512\".  Add /codes to\n"
+          "\t\t change the hysteresis from %d, e.g. \"0+512/20\"\n"
+          "  -V\t\t with -a, write variances too\n"
+          "  -C profile\t calibrate each channel for the input feeding it, using\n"
+          "\t\t the offsets, gains and linearity tables in profile (see\n"
+          "\t\t prudaq_calibration.h, or selftest -c to make one)\n"
+          "  -F format\t with -C, write \"s16\" (default) 16-bit samples in\n"
+          "\t\t 32nds of a code, or \"float\" 32-bit floats, in the\n"
+          "\t\t layout -l asks for\n"
+          "  -b words\t copy out and write at most this many words at a time\n"
+          "\t\t (default: the whole ring buffer)\n"
+          "  -u usec\t how long to sleep between drains (default: 100)\n"
+          "  -A margin\t instead of capturing, find the fastest clock this\n"
+          "\t\t board, output and load can keep up with, back off by\n"
+          "\t\t margin percent, and find the -b and -u that use the\n"
+          "\t\t least CPU at that rate.  Samples go to the output as\n"
+          "\t\t usual, since it's part of what's being tested\n"
+          "  -S file\t with -A, save the flags it picked to file, e.g. for\n"
+          "\t\t sudo ./prudaq_capture $(cat file) ...\n\n",
+          PRUDAQ_TRIGGER_HYSTERESIS
          );
   exit(EXIT_FAILURE);
 }
 
+// Writes count sample words in the requested layout.  The words are
+// masked in place.
+void write_samples(output_t *output, uint32_t *words, uint32_t count) {
+  if (output->calibration) {
+    // Calibrating replaces masking or demuxing, in the same pass
+    uint32_t size = prudaq_calibration_sample_size(output->calibration);
+    uint8_t *channel0 = output->calibrated;
+    if (output->layout == LAYOUT_INTERLEAVED) {
+      prudaq_calibrate(output->calibration, output->inputs[0],
+                       output->inputs[1], words, channel0, channel0 + size,
+                       2, count);
+      fwrite(channel0, 2 * size * count, 1, output->fout[0]);
+      return;
+    }
+    uint8_t *channel1 = output->calibrated + size * count;
+    prudaq_calibrate(output->calibration, output->inputs[0],
+                     output->inputs[1], words,
+                     output->fout[0] ? channel0 : NULL,
+                     output->fout[1] ? channel1 : NULL, 1, count);
+    for (int channel = 0; channel < 2; channel++) {
+      if (output->fout[channel]) {
+        fwrite(channel ? channel1 : channel0, size * count, 1,
+               output->fout[channel]);
+      }
+    }
+    return;
+  }
+
+  if (output->layout == LAYOUT_INTERLEAVED) {
+    // Mask off the clock and input select bits so that we output just
+    // the sample data.
+    prudaq_mask(words, count);
+    fwrite(words, count * sizeof(*words), 1, output->fout[0]);
+    return;
+  }
+
+  prudaq_demux(words,
+               output->fout[0] ? output->planes[0] : NULL,
+               output->fout[1] ? output->planes[1] : NULL,
+               count);
+  for (int channel = 0; channel < 2; channel++) {
+    if (output->fout[channel]) {
+      fwrite(output->planes[channel], count * sizeof(uint16_t), 1,
+             output->fout[channel]);
+    }
+  }
+}
+
+// Opens the source of live commands: stdin for "-", otherwise a unix
+// datagram socket created at path.  Returns -1 on failure.
+int control_open(control_t *control, const char *path) {
+  control->len = 0;
+
+  if (0 == strcmp(path, "-")) {
+    control->fd = STDIN_FILENO;
+    control->is_socket = 0;
+  } else {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+      fprintf(stderr, "Control socket path too long: %s\n", path);
+      return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    control->fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    control->is_socket = 1;
+    if (control->fd < 0) {
+      perror("unable to create control socket");
+      return -1;
+    }
+    // Clean up after a previous run that didn't exit cleanly
+    unlink(path);
+    if (0 != bind(control->fd, (struct sockaddr *) &addr, sizeof(addr))) {
+      perror("unable to bind control socket");
+      return -1;
+    }
+  }
+
+  // We poll this from the capture loop, so it must never block
+  int flags = fcntl(control->fd, F_GETFL);
+  if (flags < 0 || fcntl(control->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    perror("unable to make control input non-blocking");
+    return -1;
+  }
+  return 0;
+}
+
+// Applies one line of commands to settings.  Bad commands are reported and
+// ignored, along with the rest of their line.
+void control_command(char *line, prudaq_settings_t *settings) {
+  prudaq_settings_t updated = *settings;
+  char *save = NULL;
+  char *name = strtok_r(line, " \t\r\n", &save);
+  while (name) {
+    char *arg = strtok_r(NULL, " \t\r\n", &save);
+    char *end = NULL;
+    if (!arg) {
+      fprintf(stderr, "Command %s is missing its value\n", name);
+      return;
+    }
+    if (0 == strcmp(name, "f")) {
+      uint32_t high_cycles, low_cycles;
+      updated.freq = strtod(arg, &end);
+      if (*end ||
+          0 != prudaq_clock_cycles(updated.freq, &high_cycles, &low_cycles)) {
+        fprintf(stderr, "Bad frequency %s\n", arg);
+        return;
+      }
+    } else if (0 == strcmp(name, "i")) {
+      updated.channel0_input = strtol(arg, &end, 0);
+      if (*end || updated.channel0_input < 0 || updated.channel0_input > 3) {
+        fprintf(stderr, "i value must be between 0 and 3\n");
+        return;
+      }
+    } else if (0 == strcmp(name, "q")) {
+      updated.channel1_input = strtol(arg, &end, 0);
+      if (*end || updated.channel1_input < 4 || updated.channel1_input > 7) {
+        fprintf(stderr, "q value must be between 4 and 7\n");
+        return;
+      }
+    } else {
+      fprintf(stderr, "Unknown command %s\n", name);
+      return;
+    }
+    name = strtok_r(NULL, " \t\r\n", &save);
+  }
+  *settings = updated;
+}
+
+// Reads whatever commands are waiting, without blocking, and applies them
+// to settings.
+void control_poll(control_t *control, prudaq_settings_t *settings) {
+  while (1) {
+    int space = sizeof(control->buf) - 1 - control->len;
+    ssize_t n = read(control->fd, &(control->buf[control->len]), space);
+    if (n <= 0) {
+      if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("control input");
+      }
+      return;
+    }
+    control->len += n;
+    control->buf[control->len] = '\0';
+
+    char *line = control->buf;
+    char *newline = NULL;
+    while (NULL != (newline = strchr(line, '\n'))) {
+      *newline = '\0';
+      control_command(line, settings);
+      line = newline + 1;
+    }
+    control->len -= line - control->buf;
+    if (control->is_socket || control->len == (int) sizeof(control->buf) - 1) {
+      // The rest of the datagram, or an overlong line
+      control_command(line, settings);
+      control->len = 0;
+    } else {
+      memmove(control->buf, line, control->len);
+    }
+  }
+}
+
+// Hands count words to the averager with -a, or writes them out otherwise
+void output_words(drain_t *d, uint32_t *words, uint32_t count) {
+  if (d->averager) {
+    if (0 != prudaq_averager_add(d->averager, words, count)) {
+      bCont = 0;
+    }
+  } else {
+    write_samples(d->output, words, count);
+  }
+}
+
+// Outputs count words, the first of which is sample index, switching the
+// output over to each pending change's inputs at the sample it took effect.
+void output_switched(drain_t *d, uint64_t index, uint32_t *words,
+                     uint32_t count) {
+  uint32_t done = 0;
+  while (d->switch_count > 0) {
+    switch_t *next = &(d->switches[d->switch_head]);
+    if (next->at >= index + count) break;
+    uint32_t at = next->at > index ? next->at - index : 0;
+    if (at > done) {
+      output_words(d, &(words[done]), at - done);
+      done = at;
+    }
+    d->output->inputs[0] = next->inputs[0];
+    d->output->inputs[1] = next->inputs[1];
+    // A record mustn't mix sample rates
+    if (d->averager && next->freq != d->freq) {
+      prudaq_averager_discard(d->averager);
+    }
+    d->freq = next->freq;
+    d->switch_head = (d->switch_head + 1) % MAX_PENDING_SWITCHES;
+    d->switch_count--;
+  }
+  if (done < count) {
+    output_words(d, &(words[done]), count - done);
+  }
+}
+
+// Moves everything the PRUs have written since last time to the output,
+// recording overruns, time anchors and settings changes in the markers
+// file along the way.  Returns the number of words drained.
+uint32_t drain(drain_t *d) {
+  // Reading from shared memory and PRU RAM is significantly slower than normal
+  // memory, so we take everything that's available in one go.
+  prudaq_span_t spans[2];
+  struct timespec before, after;
+  clock_gettime(CLOCK_REALTIME, &before);
+  int span_count = prudaq_acquire(d->daq, spans);
+  clock_gettime(CLOCK_REALTIME, &after);
+
+  uint64_t first_sample = prudaq_samples_read(d->daq);
+  uint32_t lost = prudaq_check_overrun(d->daq);
+  if (lost > 0) {
+    fprintf(stderr, "Buffer overrun: lost %u samples from sample %" PRIu64
+            "\n", lost, first_sample);
+    if (d->fmarkers) {
+      fprintf(d->fmarkers, "G %" PRIu64 " %u\n", first_sample, lost);
+      fflush(d->fmarkers);
+    }
+    d->lost += lost;
+    // The record in progress is missing samples
+    if (d->averager) {
+      prudaq_averager_discard(d->averager);
+    }
+  }
+
+  // Checking before writing anything out means the new inputs always take
+  // effect in what we've just acquired or later, so the samples before
+  // the switch can still be calibrated for the old ones.
+  prudaq_settings_t applied;
+  uint64_t sample;
+  if (d->switch_count < MAX_PENDING_SWITCHES &&
+      prudaq_poll_settings(d->daq, &applied, &sample)) {
+    fprintf(stderr, "Switched to inputs %d and %d at %.2fHz"
+            " from sample %" PRIu64 "\n",
+            applied.channel0_input, applied.channel1_input,
+            actual_freq(applied.freq), sample);
+    if (d->fmarkers) {
+      fprintf(d->fmarkers, "S %" PRIu64 " %d %d %.2f\n", sample,
+              applied.channel0_input, applied.channel1_input,
+              actual_freq(applied.freq));
+      fflush(d->fmarkers);
+    }
+    d->switched = 1;
+    switch_t *queued = &(d->switches[(d->switch_head + d->switch_count) %
+                                     MAX_PENDING_SWITCHES]);
+    queued->at = sample;
+    queued->inputs[0] = applied.channel0_input;
+    queued->inputs[1] = applied.channel1_input;
+    queued->freq = applied.freq;
+    d->switch_count++;
+  }
+
+  uint32_t words = 0;
+  for (int i = 0; i < span_count; i++) {
+    words += spans[i].count;
+  }
+  if (words * sizeof(uint32_t) > d->max_backlog) {
+    d->max_backlog = words * sizeof(uint32_t);
+  }
+
+  // The newest word was written within a sample period of when
+  // prudaq_acquire() read the write pointer, so unless we were preempted
+  // in between, that pins the sample just past it to the realtime clock
+  // within a few microseconds.
+  int64_t bracket_ns = (after.tv_sec - before.tv_sec) * 1000000000LL +
+                       (after.tv_nsec - before.tv_nsec);
+  if (d->fmarkers && words > 0 && after.tv_sec != d->anchored &&
+      bracket_ns < 20000) {
+    int64_t anchor_ns = before.tv_nsec + bracket_ns / 2;
+    fprintf(d->fmarkers, "T %" PRIu64 " %ld.%09ld\n",
+            prudaq_samples_read(d->daq) + words,
+            (long) (before.tv_sec + anchor_ns / 1000000000),
+            (long) (anchor_ns % 1000000000));
+    fflush(d->fmarkers);
+    d->anchored = after.tv_sec;
+  }
+
+  // Copy from the slow DMA coherent buffer to fast normal RAM a block at a
+  // time, so that what we copy is still in the cache when we write it out.
+  uint64_t index = prudaq_samples_read(d->daq);
+  for (int i = 0; i < span_count; i++) {
+    for (uint32_t done = 0; done < spans[i].count; done += d->block) {
+      uint32_t count = spans[i].count - done < d->block ?
+                       spans[i].count - done : d->block;
+      memcpy(d->local_buf, &(spans[i].words[done]),
+             count * sizeof(*(d->local_buf)));
+      if (d->pyramid) {
+        prudaq_pyramid_add(d->pyramid, d->local_buf, count);
+      }
+      // Stages see the words before write_samples() masks them
+      if (d->chain && 0 != prudaq_chain_process(d->chain, d->local_buf,
+                                                 count)) {
+        bCont = 0;
+      }
+      output_switched(d, index, d->local_buf, count);
+      index += count;
+    }
+  }
+  prudaq_release(d->daq);
+  return words;
+}
+
+double cpu_seconds(void) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+         usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+double wall_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Switches to freq, then drains for the given number of seconds with the
+// given block size and poll interval, and reports how it went.  Returns -1
+// if interrupted.
+int trial(drain_t *d, prudaq_settings_t *settings, double freq,
+          double seconds, uint32_t block, int poll_us, trial_t *result) {
+  d->block = block;
+  if (settings->freq != freq) {
+    settings->freq = freq;
+    d->switched = 0;
+    if (0 != prudaq_configure(d->daq, settings)) {
+      return -1;
+    }
+    while (bCont && !d->switched) {
+      drain(d);
+      usleep(poll_us);
+    }
+  }
+
+  // Start from an empty ring
+  drain(d);
+  d->lost = 0;
+  d->max_backlog = 0;
+  double cpu_start = cpu_seconds();
+  double wall_start = wall_seconds();
+  double wall_end = wall_start + seconds;
+  while (bCont && wall_seconds() < wall_end) {
+    drain(d);
+    usleep(poll_us);
+  }
+
+  result->lost = d->lost;
+  result->max_backlog = d->max_backlog;
+  result->cpu = (cpu_seconds() - cpu_start) / (wall_seconds() - wall_start);
+  return bCont ? 0 : -1;
+}
+
+// Whether a step kept up: nothing lost, and never more than half the ring
+// waiting, which leaves room for the odd slow write or busy moment.
+int kept_up(const trial_t *result, uint32_t ring_bytes) {
+  return result->lost == 0 && result->max_backlog < ring_bytes / 2;
+}
+
+// -A: see usage().  Returns -1 if interrupted or nothing keeps up.
+int autotune(drain_t *d, prudaq_settings_t *settings, double margin,
+             const char *save_fname) {
+  // Long enough to fill the ring a few times at the slower rates
+  const double rate_trial_seconds = 2;
+  const double cpu_trial_seconds = 1;
+  const int poll_choices[] = { 100, 200, 500, 1000, 2000, 5000, 10000, 20000 };
+  const uint32_t block_choices[] = { 4096, 16384, 65536, 262144 };
+  uint32_t ring_bytes = prudaq_ring_bytes(d->daq);
+  uint32_t ring_words = ring_bytes / sizeof(uint32_t);
+  uint32_t high_cycles, low_cycles;
+  trial_t result;
+
+  // Bisect on the clock period in PRU cycles, between PRU0's fastest and
+  // 100kHz, which anything should keep up with.
+  prudaq_clock_cycles(PRUDAQ_MAX_FREQ, &high_cycles, &low_cycles);
+  uint32_t fastest = high_cycles + low_cycles;
+  uint32_t slowest = PRUDAQ_PRU_CLK / 100e3;
+  uint32_t passed = 0;
+  uint32_t failed = fastest - 1;
+  uint32_t cycles = slowest;
+  while (passed == 0 || passed - failed > 1) {
+    double freq = PRUDAQ_PRU_CLK / cycles;
+    if (0 != trial(d, settings, freq, rate_trial_seconds, ring_words, 100,
+                   &result)) {
+      return -1;
+    }
+    int ok = kept_up(&result, ring_bytes);
+    fprintf(stderr, "%10.2fHz: %s (lost %" PRIu64 ", up to %uB waiting)\n",
+            freq, ok ? "ok" : "too fast", result.lost, result.max_backlog);
+    if (ok) {
+      passed = cycles;
+    } else if (passed == 0) {
+      fprintf(stderr, "Couldn't keep up even at %.2fHz\n", freq);
+      return -1;
+    } else {
+      failed = cycles;
+    }
+    if (cycles == slowest) {
+      cycles = fastest;
+    } else {
+      cycles = (passed + failed + 1) / 2;
+    }
+  }
+
+  uint32_t safe_cycles = (uint32_t) (passed * (1 + margin / 100) + 0.999);
+  double safe_freq = PRUDAQ_PRU_CLK / safe_cycles;
+  fprintf(stderr, "\nKept up at up to %.2fHz.  With a %.0f%% margin,"
+          " that's %.2fHz\n\n", PRUDAQ_PRU_CLK / passed, margin, safe_freq);
+
+  // Sleeping longer means fewer wakeups and bigger batches, until the
+  // ring gets too full.  Then see what block size suits the cache.
+  int best_poll = 100;
+  double best_cpu = 2;
+  for (unsigned i = 0; i < sizeof(poll_choices) / sizeof(*poll_choices); i++) {
+    if (0 != trial(d, settings, safe_freq, cpu_trial_seconds, ring_words,
+                   poll_choices[i], &result)) {
+      return -1;
+    }
+    fprintf(stderr, "-u %5d: %5.1f%% CPU%s\n", poll_choices[i],
+            result.cpu * 100, kept_up(&result, ring_bytes) ? "" : ", too slow");
+    if (kept_up(&result, ring_bytes) && result.cpu < best_cpu) {
+      best_poll = poll_choices[i];
+      best_cpu = result.cpu;
+    }
+  }
+  uint32_t best_block = ring_words;
+  for (unsigned i = 0; i < sizeof(block_choices) / sizeof(*block_choices);
+       i++) {
+    if (block_choices[i] >= ring_words) break;
+    if (0 != trial(d, settings, safe_freq, cpu_trial_seconds, block_choices[i],
+                   best_poll, &result)) {
+      return -1;
+    }
+    fprintf(stderr, "-b %6u: %5.1f%% CPU%s\n", block_choices[i],
+            result.cpu * 100, kept_up(&result, ring_bytes) ? "" : ", too slow");
+    if (kept_up(&result, ring_bytes) && result.cpu < best_cpu) {
+      best_block = block_choices[i];
+      best_cpu = result.cpu;
+    }
+  }
+
+  char flags[64];
+  snprintf(flags, sizeof(flags), "-f %.2f -b %u -u %d", safe_freq, best_block,
+           best_poll);
+  fprintf(stderr, "\nUse %s (%.1f%% CPU)\n", flags, best_cpu * 100);
+  if (save_fname) {
+    FILE *fsave = fopen(save_fname, "w");
+    if (NULL == fsave) {
+      perror("unable to open -S file");
+      return -1;
+    }
+    fprintf(fsave, "%s\n", flags);
+    fclose(fsave);
+  }
+  return 0;
+}
+
 
 int main (int argc, char **argv) {
   int ch = -1;
@@ -70,6 +675,25 @@ int main (int argc, char **argv) {
   int channel1_input = 4;
   char* fname = "-";
   FILE* fout = stdout;
+  output_t output = { LAYOUT_INTERLEAVED };
+  char* control_path = NULL;
+  control_t control = { .fd = -1 };
+  char* marker_fname = NULL;
+  FILE* fmarkers = NULL;
+  char* pyramid_prefix = NULL;
+  prudaq_pyramid_t* pyramid = NULL;
+  prudaq_chain_t* chain = NULL;
+  uint32_t average_records = 0;
+  uint32_t average_length = 0;
+  prudaq_trigger_t trigger = { PRUDAQ_TRIGGER_SELECT, 0, -1 };
+  int variance = 0;
+  prudaq_averager_t* averager = NULL;
+  char* calibration_fname = NULL;
+  prudaq_calibrated_format_t calibrated_format = PRUDAQ_CALIBRATED_S16;
+  uint32_t block = 0;
+  int poll_us = 100;
+  double margin = -1;
+  char* save_fname = NULL;
 
   // Make sure we're root
   if (geteuid() != 0) {
@@ -78,7 +702,7 @@ int main (int argc, char **argv) {
   }
 
   // Process command line flags
-  while (-1 != (ch = getopt(argc, argv, "f:i:q:o:"))) {
+  while (-1 != (ch = getopt(argc, argv, "f:i:q:o:l:c:m:p:s:a:t:VC:F:b:u:A:S:"))) {
     switch (ch) {
     case 'f':
       gpiofreq = strtod(optarg, NULL);
@@ -100,6 +724,90 @@ int main (int argc, char **argv) {
     case 'o':
       fname = optarg;
       break;
+    case 'l':
+      if (0 == strcmp(optarg, "interleaved")) {
+        output.layout = LAYOUT_INTERLEAVED;
+      } else if (0 == strcmp(optarg, "0")) {
+        output.layout = LAYOUT_CHANNEL0;
+      } else if (0 == strcmp(optarg, "1")) {
+        output.layout = LAYOUT_CHANNEL1;
+      } else if (0 == strcmp(optarg, "planar")) {
+        output.layout = LAYOUT_PLANAR;
+      } else {
+        fprintf(stderr, "\nUnknown layout %s\n", optarg);
+        usage(argv[0]);
+      }
+      break;
+    case 'c':
+      control_path = optarg;
+      break;
+    case 'm':
+      marker_fname = optarg;
+      break;
+    case 'p':
+      pyramid_prefix = optarg;
+      break;
+    case 's':
+      if (!chain && !(chain = prudaq_chain_create())) {
+        return EXIT_FAILURE;
+      }
+      if (0 != prudaq_chain_load(chain, optarg)) {
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'a':
+      if (2 != sscanf(optarg, "%u:%u", &average_records, &average_length) ||
+          average_records < 1 || average_length < 1) {
+        fprintf(stderr, "\n-a needs records:length, e.g. 1000:256\n");
+        usage(argv[0]);
+      }
+      break;
+    case 't':
+      if (0 != prudaq_trigger_parse(optarg, &trigger)) {
+        fprintf(stderr, "\nBad trigger %s\n", optarg);
+        usage(argv[0]);
+      }
+      break;
+    case 'V':
+      variance = 1;
+      break;
+    case 'C':
+      calibration_fname = optarg;
+      break;
+    case 'F':
+      if (0 == strcmp(optarg, "s16")) {
+        calibrated_format = PRUDAQ_CALIBRATED_S16;
+      } else if (0 == strcmp(optarg, "float")) {
+        calibrated_format = PRUDAQ_CALIBRATED_FLOAT;
+      } else {
+        fprintf(stderr, "\n-F must be s16 or float\n");
+        usage(argv[0]);
+      }
+      break;
+    case 'b':
+      block = strtoul(optarg, NULL, 0);
+      if (block < 1) {
+        fprintf(stderr, "\n-b value must be at least 1\n");
+        usage(argv[0]);
+      }
+      break;
+    case 'u':
+      poll_us = strtol(optarg, NULL, 0);
+      if (poll_us < 0) {
+        fprintf(stderr, "\n-u value can't be negative\n");
+        usage(argv[0]);
+      }
+      break;
+    case 'A':
+      margin = strtod(optarg, NULL);
+      if (margin < 0) {
+        fprintf(stderr, "\n-A margin can't be negative\n");
+        usage(argv[0]);
+      }
+      break;
+    case 'S':
+      save_fname = optarg;
+      break;
     default:
       usage(argv[0]);
       break;
@@ -114,196 +822,226 @@ int main (int argc, char **argv) {
   argc -= optind;
   argv += optind;
 
-  if (0 != strcmp(fname, "-")) {
-    fout = fopen(fname, "w");
-    if (NULL == fout) {
-      perror("unable to open output file");
+  if (output.layout == LAYOUT_PLANAR) {
+    if (0 == strcmp(fname, "-")) {
+      fprintf(stderr, "\nThe planar layout needs an output filename\n");
+      usage(argv[0]);
+    }
+    for (int channel = 0; channel < 2; channel++) {
+      char plane_fname[strlen(fname) + 3];
+      sprintf(plane_fname, "%s.%d", fname, channel);
+      output.fout[channel] = fopen(plane_fname, "w");
+      if (NULL == output.fout[channel]) {
+        perror("unable to open output file");
+        return EXIT_FAILURE;
+      }
+    }
+  } else {
+    if (0 != strcmp(fname, "-")) {
+      fout = fopen(fname, "w");
+      if (NULL == fout) {
+        perror("unable to open output file");
+        return EXIT_FAILURE;
+      }
+    }
+    output.fout[output.layout == LAYOUT_CHANNEL1 ? 1 : 0] = fout;
+  }
+
+  if (average_records) {
+    if (output.layout != LAYOUT_INTERLEAVED) {
+      fprintf(stderr, "\n-a writes averages of both channels, so -l doesn't"
+              " apply\n");
+      usage(argv[0]);
+    }
+    averager = prudaq_averager_create(&trigger, average_length,
+                                      average_records, variance, fout);
+    if (!averager) {
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (calibration_fname) {
+    if (average_records) {
+      fprintf(stderr, "\n-a averages raw codes, so -C doesn't apply\n");
+      usage(argv[0]);
+    }
+    output.calibration = prudaq_calibration_load(calibration_fname,
+                                                 calibrated_format);
+    if (!output.calibration) {
+      return EXIT_FAILURE;
+    }
+    output.inputs[0] = channel0_input;
+    output.inputs[1] = channel1_input;
+  }
+
+  if (marker_fname) {
+    fmarkers = fopen(marker_fname, "w");
+    if (NULL == fmarkers) {
+      perror("unable to open markers file");
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (pyramid_prefix) {
+    pyramid = prudaq_pyramid_create(pyramid_prefix);
+    if (!pyramid) {
+      return EXIT_FAILURE;
     }
   }
 
+  if (control_path && 0 != control_open(&control, control_path)) {
+    return EXIT_FAILURE;
+  }
+
   // Install signal handler to catch ctrl-C
   if (SIG_ERR == signal(SIGINT, sig_handler)) {
     perror("Warn: signal handler not installed %d\n");
   }
 
-  // This segfaults if we're not root.
-  prussdrv_init();
-  if (0 != prussdrv_open(PRU_EVTOUT_0)) {
-    fprintf(stderr,
-            "prussdrv_open() failed. (Did you forget to run setup.sh?)\n");
+  prudaq_t *daq = prudaq_open();
+  if (!daq) {
     return EXIT_FAILURE;
   }
+  unsigned int shared_ddr_len = prudaq_ring_bytes(daq);
 
-  tpruss_intc_initdata pruss_intc_initdata = PRUSS_INTC_INITDATA;
-  prussdrv_pruintc_init(&pruss_intc_initdata);
-
-  // Get pointer into the 8KB of shared PRU DRAM where prudaq expects
-  // to share params with prus and the main cpu
-  volatile pruparams_t *pparams = NULL;
-  prussdrv_map_prumem(PRUSS0_SHARED_DATARAM, (void**)&pparams);
-
-  // Pointer into the DDR RAM mapped by the uio_pruss kernel module.
-  volatile uint32_t *shared_ddr = NULL;
-  prussdrv_map_extmem((void**)&shared_ddr);
-  unsigned int shared_ddr_len = prussdrv_extmem_size();
-  unsigned int physical_address = prussdrv_get_phys_addr((void*)shared_ddr);
+  if (block == 0 || block > shared_ddr_len / sizeof(uint32_t)) {
+    block = shared_ddr_len / sizeof(uint32_t);
+  }
 
   // Accessing the shared memory is slow, so later we'll efficiently copy it out
-  // into this local buffer.
-  uint32_t *local_buf = (uint32_t *) malloc(shared_ddr_len);
-  if (!local_buf) {
+  // into this local buffer.  -A tries blocks up to the whole ring.
+  size_t local_bytes = margin < 0 ? block * sizeof(uint32_t) : shared_ddr_len;
+  uint32_t *local_buf = (uint32_t *) malloc(local_bytes);
+  // And then demux each channel into these when asked to
+  output.planes[0] = (uint16_t *) malloc(local_bytes / 2);
+  output.planes[1] = (uint16_t *) malloc(local_bytes / 2);
+  // Calibrated samples take up to two floats per word
+  if (output.calibration) {
+    output.calibrated = (uint8_t *) malloc(2 * local_bytes);
+    if (!output.calibrated) {
+      fprintf(stderr, "Couldn't allocate memory.\n");
+      return EXIT_FAILURE;
+    }
+  }
+  if (!local_buf || !output.planes[0] || !output.planes[1]) {
     fprintf(stderr, "Couldn't allocate memory.\n");
     return EXIT_FAILURE;
   }
 
-  fprintf(stderr,
-          "%uB of shared DDR available.\n Physical (PRU-side) address:%x\n",
-         shared_ddr_len, physical_address);
-  fprintf(stderr, "Virtual (linux-side) address: %p\n\n", shared_ddr);
+  fprintf(stderr, "%uB of shared DDR available.\n\n", shared_ddr_len);
   if (shared_ddr_len < 1e6) {
     fprintf(stderr, "Shared buffer length is unexpectedly small.  Buffer overruns"
             " are likely at higher sample rates.  (Perhaps extram_pool_sz didn't"
             " get set when uio_pruss kernel module loaded.  See setup.sh)\n");
   }
 
-  // We'll use the first 8 bytes of PRU memory to tell it where the
-  // shared segment of system memory is.
-  pparams->physical_addr = physical_address;
-  pparams->ddr_len       = shared_ddr_len;
-
-  // Calculate the GPIO clock high and low cycle counts.
-  // Adding 0.5 and truncating is equivalent to rounding
-  int cycles = (PRU_CLK/gpiofreq + 0.5);
-  fprintf(stderr, "Actual GPIO clock speed is %.2fHz\n", PRU_CLK/((float)cycles));
-
-  if (cycles < 12) {
-    fprintf(stderr, "Requested frequency too high (max: 16666666)\n");
+  // What we've asked PRU0 for, and what we'll ask for next
+  prudaq_settings_t current = { gpiofreq, channel0_input, channel1_input };
+  prudaq_settings_t wanted = current;
+  if (0 != prudaq_configure(daq, &current)) {
     return EXIT_FAILURE;
   }
-  pparams->high_cycles = cycles/2;
-  pparams->low_cycles  = cycles - pparams->high_cycles;
+  fprintf(stderr, "Actual GPIO clock speed is %.2fHz\n", actual_freq(gpiofreq));
 
-  if (gpiofreq > 5e6) {
+  if (gpiofreq > 5e6 && margin < 0) {
     fprintf(stderr, "Sampling both channels faster than 5MSPS with prudaq_capture"
             " is likely to cause buffer overruns due to limited DMA bandwidth."
-            " Consider using BeagleLogic's PRUDAQ support instead.\n");
+            " (-A finds the limit for this setup.)  Consider using BeagleLogic's"
+            " PRUDAQ support instead.\n");
   }
 
-  // Decide the value that'll get written to PRU0's register r30
-  // See the docs for how bits in r30 correspond to the INPUT0A/
-  // INPUT0B/INPUT1A/INPUT1B control lines on the analog switches.
-  uint32_t pru0r30 = 0;
-  switch (channel0_input) {
-    case 0: break;
-    case 1: pru0r30 |= (1 << 1); break;
-    case 2: pru0r30 |= (1 << 2); break;
-    case 3: pru0r30 |= (1 << 1) | (1 << 2); break;
+  if (fmarkers) {
+    fprintf(fmarkers, "S 0 %d %d %.2f\n", channel0_input, channel1_input,
+            actual_freq(gpiofreq));
+    fflush(fmarkers);
   }
-  switch (channel1_input) {
-    case 4: break;
-    case 5: pru0r30 |= (1 << 3); break;
-    case 6: pru0r30 |= (1 << 5); break;
-    case 7: pru0r30 |= (1 << 3) | (1 << 5); break;
-  }
-  pparams->input_select = pru0r30;
 
   // Load the .bin files into PRU0 and PRU1
-  prussdrv_exec_program(0, argv[0]);
-  prussdrv_exec_program(1, argv[1]);
-
-  uint32_t max_index = shared_ddr_len / sizeof(shared_ddr[0]);
-  uint32_t read_index = 0;
-  time_t now = time(NULL);
-  time_t start_time = now;
-  uint32_t bytes_read = 0;
-  int loops = 0;
-  while (bCont) {
-    // Reading from shared memory and PRU RAM is significantly slower than normal
-    // memory, so we loop below rather than checking shared_ptr every time, and
-    // we only check bytes_written once in a while.
-    uint32_t *write_pointer_virtual = prussdrv_get_virt_addr(pparams->shared_ptr);
-    uint32_t write_index = write_pointer_virtual - shared_ddr;
-
-    if (read_index == write_index) {
-      // We managed to loop all the way back before PRU1 wrote even a single sample.
-      // Do nothing.
-
-    } else if (read_index < write_index) {
-      // Copy from the slow DMA coherent buffer to fast normal RAM
-      int bytes = (write_index - read_index) * sizeof(*shared_ddr);
-      memcpy(local_buf, (void *) &(shared_ddr[read_index]), bytes);
-      bytes_read += bytes;
-
-      // Each 32-bit word holds a pair of samples, one from each channel.
-      // Samples are 10 bits, and the remaining bits record the clock and
-      // input select state.  (See doc/InputOutput.md for details)
-
-      // Mask off the clock and input select bits so that we output just
-      // the sample data.
-      for (int i = 0; i < (write_index - read_index); i++) {
-        // Keep just the lower 10 bits from each 16-bit half of the 32-bit word
-        local_buf[i] &= 0x03ff03ff;
-      }
-
-      fwrite(local_buf, bytes, 1, fout);
+  if (0 != prudaq_start(daq, argv[0], argv[1])) {
+    return EXIT_FAILURE;
+  }
 
-    } else {
-      // The write pointer has wrapped around, so we'll copy out the data
-      // in two chunks
-      int tail_words = max_index - read_index;
-      int tail_bytes = tail_words * sizeof(*shared_ddr);
+  drain_t d = { daq, &output, pyramid, chain, averager, fmarkers, local_buf,
+                block };
+  d.freq = gpiofreq;
 
-      memcpy(local_buf, (void *) &(shared_ddr[read_index]), tail_bytes);
-      bytes_read += tail_bytes;
+  int status = 0;
+  if (margin >= 0) {
+    status = autotune(&d, &current, margin, save_fname) == 0 ? 0 : EXIT_FAILURE;
+  } else {
+    time_t now = time(NULL);
+    time_t start_time = now;
+    int loops = 0;
+    while (bCont) {
+      drain(&d);
 
-      for (int i = 0; i < tail_words; i++) {
-        local_buf[i] &= 0x03ff03ff;
+      // Every 10 passes (a millisecond at the default -u), look for new
+      // commands
+      if (control.fd >= 0 && loops % 10 == 0) {
+        control_poll(&control, &wanted);
+        if (0 != memcmp(&wanted, &current, sizeof(wanted))) {
+          if (0 == prudaq_configure(daq, &wanted)) {
+            current = wanted;
+          } else {
+            wanted = current;
+          }
+        }
       }
 
-      int head_bytes = write_index * sizeof(*shared_ddr);
-      memcpy(&(local_buf[tail_words]), (void *) shared_ddr, head_bytes);
-      bytes_read += head_bytes;
-
-      for (int i = 0; i < write_index; i++) {
-        local_buf[tail_words + i] &= 0x03ff03ff;
-      }
+      if (loops++ % 100 == 0) {
+        time_t current_time = time(NULL);
+        if (now != current_time) {
+          now = current_time;
+          // There's a race condition here where the PRU will often update
+          // bytes_written after we checked the write pointer, so don't
+          // worry about small differences.  Samples lost to overruns count
+          // as read.
+          uint32_t bytes_read = prudaq_samples_read(daq) * sizeof(uint32_t);
+          uint32_t bytes_written = bytes_read + prudaq_backlog(daq);
 
-      fwrite(local_buf, tail_bytes + head_bytes, 1, fout);
-    }
-    read_index = write_index;
-
-    if (loops++ % 100 == 0) {
-      time_t current_time = time(NULL);
-      if (now != current_time) {
-        now = current_time;
-        // There's a race condition here where the PRU will often update bytes_written
-        // after we checked write_index, so don't worry about small differences. If the
-        // buffer overruns, we'll end up being off by an entire buffer worth.
-        uint32_t bytes_written = pparams->bytes_written;
-        int64_t difference = ((int64_t) bytes_written) - bytes_read;
-        if (difference < 0) {
-          difference = ((uint32_t) bytes_written + shared_ddr_len) -
-                       ((uint32_t) bytes_read + shared_ddr_len);
+          fprintf(stderr, "\t%ld bytes / second. %uB written, %uB read.\n",
+                  bytes_written / (now - start_time), bytes_written,
+                  bytes_read);
         }
-  
-        fprintf(stderr, "\t%ld bytes / second. %uB written, %uB read.\n",
-                bytes_written / (now - start_time), bytes_written, bytes_read);
       }
+      usleep(poll_us);
     }
-    usleep(100);
   }
 
-  // Wait for the PRU to let us know it's done
-  //prussdrv_pru_wait_event(PRU_EVTOUT_0);
   fprintf(stderr, "All done\n");
 
-  prussdrv_pru_disable(0);
-  prussdrv_pru_disable(1);
-  prussdrv_exit();
+  prudaq_close(daq);
 
-  if (stdout != fout) {
-    fclose(fout);
+  for (int channel = 0; channel < 2; channel++) {
+    if (output.fout[channel] && stdout != output.fout[channel]) {
+      fclose(output.fout[channel]);
+    }
+  }
+  if (fmarkers) {
+    fclose(fmarkers);
+  }
+  if (pyramid && 0 != prudaq_pyramid_finish(pyramid)) {
+    status = EXIT_FAILURE;
+  }
+  if (output.calibration) {
+    prudaq_calibration_destroy(output.calibration);
+  }
+  if (averager) {
+    fprintf(stderr, "Wrote %" PRIu64 " averages\n",
+            prudaq_averager_averages(averager));
+    prudaq_averager_destroy(averager);
+  }
+  if (chain) {
+    if (0 != prudaq_chain_flush(chain)) {
+      status = EXIT_FAILURE;
+    }
+    prudaq_chain_report(chain, stderr);
+    prudaq_chain_destroy(chain);
+  }
+  if (control.is_socket) {
+    close(control.fd);
+    unlink(control_path);
   }
 
-  return 0;
+  return status;
 }
@@ -0,0 +1,611 @@
+/*
+Copyright 2015 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied.  See the License for the specific language governing
+permissions and limitations under the License.
+*/
+
+/*
+Merges captures from several PRUDAQ boards into one multi-channel file.
+
+Each source is the data from one prudaq_capture (in the default interleaved
+layout) plus the markers file it wrote with -m.  Sources can be finished
+files, or FIFOs fed live from the boards (over ssh, say), and each gets
+its own thread reading it into a bounded queue so that one slow source
+doesn't hold up reading the others.
+
+Sources are aligned using the "T sample seconds" anchors prudaq_capture
+records, which tie a sample index to the board's realtime clock.  Each
+source's anchors are fitted with a line, so that jitter in individual
+anchors averages out and differences between the boards' sample clocks
+show up as drift.  Source 0 is the reference: frame n of the output holds
+the sample each source took closest to when source 0 took sample n + the
+start offset.  That's only as good as the boards' clock synchronization,
+so use PTP (or at least NTP on a quiet network) to get close to a sample.
+When drift moves a source's alignment by a whole sample, the collector
+drops a sample or leaves a frame empty at that point and logs it.
+
+"G sample count" markers from buffer overruns become gaps, so a source's
+samples stay at the right frames after losing some.  Frames where a source
+has no sample hold 0xffff for both of its channels, which can't be a 10-bit
+sample.
+
+The output has one 32-bit word per source per frame, in source order, each
+laid out like prudaq_capture's interleaved words.  The log records:
+
+  A source offset drift_ppm   source sample = frame + offset, at frame 0
+  G source sample count       count samples missing from the source
+  P source frame slip         the offset changed by slip at frame
+  E source frame              the source ran out of samples at frame
+
+To try it out without boards, replay captures through FIFOs:
+  mkfifo a b
+  prudaq_collect -o merged a:a.markers b:b.markers &
+  cat a.bin > a & cat b.bin > b
+*/
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <pthread.h>
+
+#define MAX_SOURCES 16
+
+// Frames merged at a time.  Offsets only change between blocks.
+#define BLOCK_FRAMES 4096
+
+// Both channels 0xffff, which no 10-bit sample can be
+#define FILL_WORD 0xffffffff
+
+// How far the ideal offset has to drift from the current one before a
+// source slips a sample, so that jitter in the anchors doesn't make it
+// flip back and forth.
+#define SLIP_THRESHOLD 0.75
+
+// Straight line fit of realtime against sample index.  x is samples after
+// the first anchor and y is seconds after base_sec, which keeps the sums
+// well within double precision.
+typedef struct {
+  int anchors;
+  int64_t base_sec;
+  uint64_t first_sample;
+  double mean_x, mean_y;
+  double cxx, cxy;
+  // Sample rate from the latest "S" marker, for sources with one anchor
+  double freq;
+} fit_t;
+
+typedef struct {
+  uint64_t sample;
+  uint64_t count;
+} gap_t;
+
+typedef struct {
+  int index;
+  char *data_fname;
+  char *markers_fname;
+  int fd;
+  FILE *fmarkers;
+  char line[256];
+  int line_len;
+
+  // Gaps from the markers file that the reader hasn't reached yet
+  gap_t *gaps;
+  int gap_count;
+  int gap_space;
+  int next_gap;
+
+  // Everything below is shared between the reader and the merger.
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  // The queue.  Gaps are filled in, so sample n of the source is pushed
+  // nth, and popped is the index of the oldest sample still queued.
+  uint32_t *ring;
+  uint64_t capacity;
+  uint64_t pushed;
+  uint64_t popped;
+  int eof;
+  fit_t fit;
+
+  // Merger only: source sample = frame + offset
+  int64_t offset;
+  int ended;
+} source_t;
+
+static FILE *flog;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void usage (char* arg0) {
+  fprintf(stderr, "\nUsage: %s [flags] data:markers ...\n", basename(arg0));
+
+  fprintf(stderr, "\n"
+          "  -o output\t merged output filename (default: stdout)\n"
+          "  -g log\t alignment and gap log filename (default: stderr)\n"
+          "  -M megabytes\t memory to use for queueing samples, shared among\n"
+          "\t\t the sources (default: 64)\n\n"
+          "Up to %d sources.  Each is the capture data and the markers\n"
+          "prudaq_capture -m wrote for it, and either can be a FIFO.  The\n"
+          "first source sets the timebase.\n\n", MAX_SOURCES
+         );
+  exit(EXIT_FAILURE);
+}
+
+void log_line(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  pthread_mutex_lock(&log_lock);
+  vfprintf(flog, format, args);
+  fflush(flog);
+  pthread_mutex_unlock(&log_lock);
+  va_end(args);
+}
+
+// Seconds per sample, from the anchors if there are enough of them
+double fit_slope(const fit_t *fit) {
+  if (fit->anchors >= 2 && fit->cxx > 0) {
+    return fit->cxy / fit->cxx;
+  }
+  return fit->freq > 0 ? 1 / fit->freq : 0;
+}
+
+void fit_add(fit_t *fit, uint64_t sample, int64_t sec, int64_t nsec) {
+  if (fit->anchors == 0) {
+    fit->base_sec = sec;
+    fit->first_sample = sample;
+  }
+  double x = (double) (sample - fit->first_sample);
+  double y = (sec - fit->base_sec) + nsec / 1e9;
+
+  // Welford's update, which doesn't lose precision the way summing
+  // squares does
+  fit->anchors++;
+  double dx = x - fit->mean_x;
+  fit->mean_x += dx / fit->anchors;
+  fit->mean_y += (y - fit->mean_y) / fit->anchors;
+  fit->cxx += dx * (x - fit->mean_x);
+  fit->cxy += dx * (y - fit->mean_y);
+}
+
+// Which sample of 'to' was taken when sample x of 'from' was, as a
+// fraction.  Both fits need at least one anchor.
+double fit_map(const fit_t *from, const fit_t *to, double x) {
+  double y = from->mean_y + fit_slope(from) *
+             (x - from->first_sample - from->mean_x);
+  y += from->base_sec - to->base_sec;
+  return to->first_sample + to->mean_x + (y - to->mean_y) / fit_slope(to);
+}
+
+void parse_marker(source_t *source, const char *line) {
+  uint64_t sample, count;
+  int input0, input1;
+  double freq;
+  int64_t sec;
+  char digits[10];
+
+  if (4 == sscanf(line, "S %" SCNu64 " %d %d %lf", &sample, &input0, &input1,
+                  &freq)) {
+    pthread_mutex_lock(&(source->lock));
+    source->fit.freq = freq;
+    pthread_mutex_unlock(&(source->lock));
+  } else if (3 == sscanf(line, "T %" SCNu64 " %" SCNd64 ".%9[0-9]", &sample,
+                         &sec, digits)) {
+    // Scale the fraction to nanoseconds whatever its number of digits
+    int64_t nsec = strtoll(digits, NULL, 10);
+    for (int i = strlen(digits); i < 9; i++) {
+      nsec *= 10;
+    }
+    pthread_mutex_lock(&(source->lock));
+    fit_add(&(source->fit), sample, sec, nsec);
+    pthread_cond_broadcast(&(source->changed));
+    pthread_mutex_unlock(&(source->lock));
+  } else if (2 == sscanf(line, "G %" SCNu64 " %" SCNu64, &sample, &count)) {
+    if (source->gap_count == source->gap_space) {
+      source->gap_space = source->gap_space ? 2 * source->gap_space : 16;
+      source->gaps = (gap_t *) realloc(source->gaps,
+                                       source->gap_space * sizeof(gap_t));
+      if (!source->gaps) {
+        fprintf(stderr, "Couldn't allocate memory.\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    source->gaps[source->gap_count].sample = sample;
+    source->gaps[source->gap_count].count = count;
+    source->gap_count++;
+  }
+}
+
+// Parses whatever whole lines have been added to the markers file since
+// last time.  At the end of the source, a final unterminated line counts
+// too.
+void read_markers(source_t *source, int final) {
+  if (!source->fmarkers) return;
+
+  while (fgets(&(source->line[source->line_len]),
+               sizeof(source->line) - source->line_len, source->fmarkers)) {
+    source->line_len = strlen(source->line);
+    if (source->line[source->line_len - 1] != '\n' &&
+        source->line_len < (int) sizeof(source->line) - 1) {
+      // The rest of the line hasn't been written yet
+      break;
+    }
+    parse_marker(source, source->line);
+    source->line_len = 0;
+  }
+  clearerr(source->fmarkers);
+
+  if (final && source->line_len > 0) {
+    parse_marker(source, source->line);
+    source->line_len = 0;
+  }
+}
+
+// Queues count words, or count fill words if words is NULL, waiting for
+// the merger to make room.
+void push(source_t *source, const uint32_t *words, uint64_t count) {
+  pthread_mutex_lock(&(source->lock));
+  while (count > 0) {
+    while (source->pushed - source->popped == source->capacity) {
+      pthread_cond_wait(&(source->changed), &(source->lock));
+    }
+    uint64_t space = source->capacity - (source->pushed - source->popped);
+    uint64_t at = source->pushed % source->capacity;
+    uint64_t n = count < space ? count : space;
+    if (n > source->capacity - at) n = source->capacity - at;
+    if (words) {
+      memcpy(&(source->ring[at]), words, n * sizeof(*words));
+      words += n;
+    } else {
+      for (uint64_t i = 0; i < n; i++) {
+        source->ring[at + i] = FILL_WORD;
+      }
+    }
+    source->pushed += n;
+    count -= n;
+    pthread_cond_broadcast(&(source->changed));
+  }
+  pthread_mutex_unlock(&(source->lock));
+}
+
+// Fills in any gaps that start at the next sample to be pushed, and returns
+// how many samples can be read before the next one.
+uint64_t fill_gaps(source_t *source) {
+  while (source->next_gap < source->gap_count) {
+    gap_t *gap = &(source->gaps[source->next_gap]);
+    uint64_t next = source->pushed;
+    if (gap->sample > next) {
+      return gap->sample - next;
+    }
+    if (gap->sample < next) {
+      fprintf(stderr, "Source %d: gap at sample %" PRIu64 " is behind the"
+              " data (at %" PRIu64 "), ignoring it\n", source->index,
+              gap->sample, next);
+    } else {
+      log_line("G %d %" PRIu64 " %" PRIu64 "\n", source->index, gap->sample,
+               gap->count);
+      push(source, NULL, gap->count);
+    }
+    source->next_gap++;
+  }
+  return UINT64_MAX;
+}
+
+void *reader_thread(void *arg) {
+  source_t *source = (source_t *) arg;
+  // Reads can end partway through a word, so keep the leftover bytes
+  union {
+    uint32_t words[16384];
+    uint8_t bytes[16384 * sizeof(uint32_t)];
+  } buf;
+  size_t leftover = 0;
+
+  while (1) {
+    read_markers(source, 0);
+    uint64_t until_gap = fill_gaps(source);
+
+    size_t want = sizeof(buf) - leftover;
+    if (until_gap < sizeof(buf) / sizeof(uint32_t)) {
+      want = until_gap * sizeof(uint32_t) - leftover;
+    }
+    ssize_t n = read(source->fd, &(buf.bytes[leftover]), want);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) {
+      fprintf(stderr, "Source %d: ", source->index);
+      perror("unable to read data");
+    }
+    if (n <= 0) break;
+
+    leftover += n;
+    size_t words = leftover / sizeof(uint32_t);
+    push(source, buf.words, words);
+    leftover -= words * sizeof(uint32_t);
+    memmove(buf.bytes, &(buf.bytes[words * sizeof(uint32_t)]), leftover);
+  }
+
+  // Gaps right at the end still count
+  read_markers(source, 1);
+  fill_gaps(source);
+
+  pthread_mutex_lock(&(source->lock));
+  source->eof = 1;
+  pthread_cond_broadcast(&(source->changed));
+  pthread_mutex_unlock(&(source->lock));
+  return NULL;
+}
+
+// Where source should be for reference sample m, or NAN if either source
+// hasn't been anchored yet.  Call with both locks held.
+double ideal_offset(const source_t *reference, const source_t *source,
+                    int64_t m) {
+  if (reference->fit.anchors == 0 || source->fit.anchors == 0 ||
+      fit_slope(&(reference->fit)) == 0 || fit_slope(&(source->fit)) == 0) {
+    return NAN;
+  }
+  return fit_map(&(reference->fit), &(source->fit), m) - m;
+}
+
+// Copies the source's samples for BLOCK_FRAMES frames from first_frame into
+// every sources'th word of column.  Returns how many of those frames got a
+// sample rather than FILL_WORD.
+int fill_column(source_t *source, int64_t first_frame, uint32_t *column,
+                int sources) {
+  int64_t first = first_frame + source->offset;
+  int real = 0;
+
+  pthread_mutex_lock(&(source->lock));
+  // Drop samples from before this block, e.g. after a slip
+  while ((int64_t) source->popped < first) {
+    if (source->pushed == source->popped) {
+      if (source->eof) break;
+      pthread_cond_wait(&(source->changed), &(source->lock));
+      continue;
+    }
+    uint64_t drop = source->pushed - source->popped;
+    if ((int64_t) drop > first - (int64_t) source->popped) {
+      drop = first - source->popped;
+    }
+    source->popped += drop;
+    pthread_cond_broadcast(&(source->changed));
+  }
+
+  for (int f = 0; f < BLOCK_FRAMES; f++) {
+    int64_t sample = first + f;
+    // Before the source starts, or already taken before a backwards slip
+    if (sample < (int64_t) source->popped) {
+      column[f * sources] = FILL_WORD;
+      continue;
+    }
+    while (source->pushed == source->popped && !source->eof) {
+      pthread_cond_wait(&(source->changed), &(source->lock));
+    }
+    if (source->pushed == source->popped) {
+      column[f * sources] = FILL_WORD;
+      continue;
+    }
+    column[f * sources] = source->ring[source->popped % source->capacity];
+    source->popped++;
+    real = f + 1;
+    if (source->popped % BLOCK_FRAMES == 0) {
+      pthread_cond_broadcast(&(source->changed));
+    }
+  }
+  pthread_cond_broadcast(&(source->changed));
+  pthread_mutex_unlock(&(source->lock));
+  return real;
+}
+
+int main (int argc, char **argv) {
+  int ch = -1;
+  char* fname = "-";
+  FILE* fout = stdout;
+  char* log_fname = NULL;
+  uint64_t budget = 64;
+
+  // Process command line flags
+  while (-1 != (ch = getopt(argc, argv, "o:g:M:"))) {
+    switch (ch) {
+    case 'o':
+      fname = optarg;
+      break;
+    case 'g':
+      log_fname = optarg;
+      break;
+    case 'M':
+      budget = strtoull(optarg, NULL, 0);
+      break;
+    default:
+      usage(argv[0]);
+      break;
+    }
+  }
+
+  int sources = argc - optind;
+  if (sources < 1 || sources > MAX_SOURCES) {
+    usage(argv[0]);
+  }
+
+  if (0 != strcmp(fname, "-")) {
+    fout = fopen(fname, "w");
+    if (NULL == fout) {
+      perror("unable to open output file");
+      return EXIT_FAILURE;
+    }
+  }
+  flog = stderr;
+  if (log_fname) {
+    flog = fopen(log_fname, "w");
+    if (NULL == flog) {
+      perror("unable to open log file");
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Each queue needs to hold at least a couple of blocks
+  uint64_t capacity = budget * 1024 * 1024 / sizeof(uint32_t) / sources;
+  if (capacity < 2 * BLOCK_FRAMES) {
+    capacity = 2 * BLOCK_FRAMES;
+  }
+
+  source_t source_list[MAX_SOURCES];
+  pthread_t threads[MAX_SOURCES];
+  memset(source_list, 0, sizeof(source_list));
+  for (int s = 0; s < sources; s++) {
+    source_t *source = &(source_list[s]);
+    source->index = s;
+    source->data_fname = argv[optind + s];
+    char *colon = strrchr(source->data_fname, ':');
+    if (colon) {
+      *colon = '\0';
+      source->markers_fname = colon + 1;
+    } else {
+      fprintf(stderr, "Source %d has no markers file, so it can't be"
+              " aligned or have its gaps filled in\n", s);
+    }
+
+    source->fd = open(source->data_fname, O_RDONLY);
+    if (source->fd < 0) {
+      perror("unable to open source data");
+      return EXIT_FAILURE;
+    }
+    if (source->markers_fname) {
+      // Non-blocking, so that a FIFO whose writer hasn't shown up yet
+      // doesn't hold up the data
+      int fd = open(source->markers_fname, O_RDONLY | O_NONBLOCK);
+      source->fmarkers = fd < 0 ? NULL : fdopen(fd, "r");
+      if (!source->fmarkers) {
+        perror("unable to open source markers");
+        return EXIT_FAILURE;
+      }
+    }
+
+    source->capacity = capacity;
+    source->ring = (uint32_t *) malloc(capacity * sizeof(uint32_t));
+    if (!source->ring) {
+      fprintf(stderr, "Couldn't allocate memory.\n");
+      return EXIT_FAILURE;
+    }
+    pthread_mutex_init(&(source->lock), NULL);
+    pthread_cond_init(&(source->changed), NULL);
+    if (0 != pthread_create(&(threads[s]), NULL, reader_thread, source)) {
+      perror("unable to start reader thread");
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Wait for every source to be anchored, unless it's full or finished
+  // without being anchored, in which case all we can do is line up its
+  // first sample with the reference's.
+  source_t *reference = &(source_list[0]);
+  for (int s = 0; s < sources; s++) {
+    source_t *source = &(source_list[s]);
+    pthread_mutex_lock(&(source->lock));
+    while (source->fit.anchors == 0 && !source->eof &&
+           source->pushed - source->popped < source->capacity) {
+      pthread_cond_wait(&(source->changed), &(source->lock));
+    }
+    pthread_mutex_unlock(&(source->lock));
+  }
+
+  // Start at the first frame every source has a sample for
+  int64_t start = 0;
+  for (int s = 0; s < sources; s++) {
+    source_t *source = &(source_list[s]);
+    pthread_mutex_lock(&(reference->lock));
+    if (source != reference) pthread_mutex_lock(&(source->lock));
+    double ideal = ideal_offset(reference, source, 0);
+    if (isnan(ideal)) {
+      fprintf(stderr, "Source %d isn't anchored, so lining it up by sample"
+              " index\n", s);
+      ideal = 0;
+    }
+    source->offset = llround(ideal);
+    if (-source->offset > start) start = -source->offset;
+    if (source != reference) pthread_mutex_unlock(&(source->lock));
+    pthread_mutex_unlock(&(reference->lock));
+  }
+  for (int s = 0; s < sources; s++) {
+    source_t *source = &(source_list[s]);
+    source->offset += start;
+    double drift = 0;
+    if (reference->fit.anchors >= 2 && source->fit.anchors >= 2) {
+      drift = (fit_slope(&(reference->fit)) / fit_slope(&(source->fit)) - 1) *
+              1e6;
+    }
+    log_line("A %d %" PRId64 " %.3f\n", s, source->offset, drift);
+  }
+
+  uint32_t *frames =
+      (uint32_t *) malloc(BLOCK_FRAMES * sources * sizeof(uint32_t));
+  if (!frames) {
+    fprintf(stderr, "Couldn't allocate memory.\n");
+    return EXIT_FAILURE;
+  }
+
+  int64_t frame = 0;
+  while (1) {
+    // Follow the anchors as they come in
+    for (int s = 1; s < sources; s++) {
+      source_t *source = &(source_list[s]);
+      pthread_mutex_lock(&(reference->lock));
+      pthread_mutex_lock(&(source->lock));
+      double ideal = ideal_offset(reference, source, start + frame);
+      pthread_mutex_unlock(&(source->lock));
+      pthread_mutex_unlock(&(reference->lock));
+      if (!isnan(ideal) && fabs(ideal + start - source->offset) > SLIP_THRESHOLD) {
+        int64_t offset = llround(ideal) + start;
+        log_line("P %d %" PRId64 " %" PRId64 "\n", s, frame,
+                 offset - source->offset);
+        source->offset = offset;
+      }
+    }
+
+    int real = 0;
+    for (int s = 0; s < sources; s++) {
+      source_t *source = &(source_list[s]);
+      int n = fill_column(source, frame, &(frames[s]), sources);
+      if (n < BLOCK_FRAMES && !source->ended) {
+        log_line("E %d %" PRId64 "\n", s, frame + n);
+        source->ended = 1;
+      }
+      if (n > real) real = n;
+    }
+
+    // Stop after the last frame any source has a sample for
+    if (real > 0 && 1 != fwrite(frames, real * sources * sizeof(uint32_t), 1,
+                                fout)) {
+      perror("unable to write output");
+      return EXIT_FAILURE;
+    }
+    frame += real;
+    if (real < BLOCK_FRAMES) break;
+  }
+
+  for (int s = 0; s < sources; s++) {
+    pthread_join(threads[s], NULL);
+  }
+  fprintf(stderr, "Merged %" PRId64 " frames from %d sources\n", frame,
+          sources);
+
+  if (stdout != fout) {
+    fclose(fout);
+  }
+  if (stderr != flog) {
+    fclose(flog);
+  }
+  return 0;
+}
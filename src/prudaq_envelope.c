@@ -0,0 +1,115 @@
+/*
+Copyright 2015 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied.  See the License for the specific language governing
+permissions and limitations under the License.
+*/
+
+/*
+Prints the envelope of a stretch of a capture at a given width, using the
+pyramid prudaq_capture -p wrote alongside it.  Each line is one pixel:
+
+  first_sample min0 max0 mean0 min1 max1 mean1
+
+This is as fast for a whole day's capture as for a few milliseconds of it,
+so it's handy for feeding plots that zoom and pan interactively.
+*/
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <libgen.h>
+
+#include "prudaq_pyramid.h"
+
+void usage (char* arg0) {
+  fprintf(stderr, "\nUsage: %s [flags] pyramid_prefix\n", basename(arg0));
+
+  fprintf(stderr, "\n"
+          "  -s start\t first sample (default: 0)\n"
+          "  -e end\t sample to stop before (default: end of capture)\n"
+          "  -w width\t number of pixels (default: 1000)\n\n"
+         );
+  exit(EXIT_FAILURE);
+}
+
+int main (int argc, char **argv) {
+  int ch = -1;
+  uint64_t start = 0;
+  uint64_t end = UINT64_MAX;
+  int width = 1000;
+
+  // Process command line flags
+  while (-1 != (ch = getopt(argc, argv, "s:e:w:"))) {
+    switch (ch) {
+    case 's':
+      start = strtoull(optarg, NULL, 0);
+      break;
+    case 'e':
+      end = strtoull(optarg, NULL, 0);
+      break;
+    case 'w':
+      width = strtol(optarg, NULL, 0);
+      if (width < 1) {
+        fprintf(stderr, "\n-w value must be at least 1\n");
+        usage(argv[0]);
+      }
+      break;
+    default:
+      usage(argv[0]);
+      break;
+    }
+  }
+
+  if (argc - optind != 1) {
+    usage(argv[0]);
+  }
+
+  prudaq_pyramid_reader_t *reader = prudaq_pyramid_open(argv[optind]);
+  if (!reader) {
+    return EXIT_FAILURE;
+  }
+  uint64_t samples = prudaq_pyramid_samples(reader);
+  if (end > samples) end = samples;
+  if (start >= end) {
+    fprintf(stderr, "The capture has %" PRIu64 " samples\n", samples);
+    return EXIT_FAILURE;
+  }
+  // Don't make up pixels between samples
+  if ((uint64_t) width > end - start) width = end - start;
+
+  prudaq_envelope_t *pixels =
+      (prudaq_envelope_t *) malloc(width * sizeof(prudaq_envelope_t));
+  if (!pixels) {
+    fprintf(stderr, "Couldn't allocate memory.\n");
+    return EXIT_FAILURE;
+  }
+
+  int level = prudaq_pyramid_render(reader, start, end, pixels, width);
+  if (level < 0) {
+    return EXIT_FAILURE;
+  }
+  fprintf(stderr, "Rendered samples %" PRIu64 "-%" PRIu64 " of %" PRIu64
+          " from level %d\n", start, end, samples, level);
+
+  for (int p = 0; p < width; p++) {
+    printf("%" PRIu64 " %u %u %.3f %u %u %.3f\n",
+           start + (end - start) * p / width,
+           pixels[p].min[0], pixels[p].max[0], pixels[p].mean[0] / 64.0,
+           pixels[p].min[1], pixels[p].max[1], pixels[p].mean[1] / 64.0);
+  }
+
+  free(pixels);
+  prudaq_pyramid_close(reader);
+  return 0;
+}
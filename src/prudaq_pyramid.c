@@ -0,0 +1,377 @@
+/*
+Copyright 2015 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied.  See the License for the specific language governing
+permissions and limitations under the License.
+*/
+
+/*
+Builds and reads the envelope pyramids described in prudaq_pyramid.h.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
+#include "prudaq_pyramid.h"
+
+// An entry that's still being built, with the exact sum so that rounding
+// in one level's means doesn't pile up in the levels above it
+typedef struct {
+  uint16_t min[2];
+  uint16_t max[2];
+  uint64_t sum[2];
+  // Samples covered so far
+  uint64_t samples;
+  // Entries from the level below (or samples, for level 1) so far
+  int children;
+} accumulator_t;
+
+struct prudaq_pyramid {
+  char *prefix;
+  // files[level - 1] and so on, since there's no level 0
+  FILE *files[PRUDAQ_PYRAMID_MAX_LEVELS];
+  uint64_t entries[PRUDAQ_PYRAMID_MAX_LEVELS];
+  accumulator_t pending[PRUDAQ_PYRAMID_MAX_LEVELS];
+  uint64_t samples;
+  int failed;
+};
+
+struct prudaq_pyramid_reader {
+  char *prefix;
+  int fds[PRUDAQ_PYRAMID_MAX_LEVELS];
+  uint64_t samples;
+  int levels;
+  // Room for the entries behind one render
+  prudaq_envelope_t *entries;
+  uint64_t entries_len;
+};
+
+static void reset(accumulator_t *accumulator) {
+  for (int c = 0; c < 2; c++) {
+    accumulator->min[c] = UINT16_MAX;
+    accumulator->max[c] = 0;
+    accumulator->sum[c] = 0;
+  }
+  accumulator->samples = 0;
+  accumulator->children = 0;
+}
+
+static void merge(accumulator_t *into, const accumulator_t *from) {
+  for (int c = 0; c < 2; c++) {
+    if (from->min[c] < into->min[c]) into->min[c] = from->min[c];
+    if (from->max[c] > into->max[c]) into->max[c] = from->max[c];
+    into->sum[c] += from->sum[c];
+  }
+  into->samples += from->samples;
+  into->children++;
+}
+
+// Summarizes count (at most PRUDAQ_PYRAMID_FANOUT) sample words
+static void summarize(const uint32_t *words, int count, accumulator_t *out) {
+  reset(out);
+  int i = 0;
+#ifdef __ARM_NEON__
+  if (count == 16) {
+    // Split both channels out of 16 words, then fold the 8 lanes of each
+    // down to one with pairwise min, max and add.
+    const uint16x8_t mask = vdupq_n_u16(0x03ff);
+    uint16x8x2_t a = vld2q_u16((const uint16_t *) words);
+    uint16x8x2_t b = vld2q_u16((const uint16_t *) &(words[8]));
+    for (int c = 0; c < 2; c++) {
+      uint16x8_t x = vandq_u16(a.val[c], mask);
+      uint16x8_t y = vandq_u16(b.val[c], mask);
+      uint16x8_t lo = vminq_u16(x, y);
+      uint16x8_t hi = vmaxq_u16(x, y);
+      uint16x4_t min = vpmin_u16(vget_low_u16(lo), vget_high_u16(lo));
+      uint16x4_t max = vpmax_u16(vget_low_u16(hi), vget_high_u16(hi));
+      min = vpmin_u16(min, min);
+      max = vpmax_u16(max, max);
+      min = vpmin_u16(min, min);
+      max = vpmax_u16(max, max);
+      uint64x2_t sum = vpaddlq_u32(vpaddlq_u16(vaddq_u16(x, y)));
+      out->min[c] = vget_lane_u16(min, 0);
+      out->max[c] = vget_lane_u16(max, 0);
+      out->sum[c] = vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1);
+    }
+    i = count;
+  }
+#endif
+  for (; i < count; i++) {
+    uint16_t samples[2] = { words[i] & 0x03ff, (words[i] >> 16) & 0x03ff };
+    for (int c = 0; c < 2; c++) {
+      if (samples[c] < out->min[c]) out->min[c] = samples[c];
+      if (samples[c] > out->max[c]) out->max[c] = samples[c];
+      out->sum[c] += samples[c];
+    }
+  }
+  out->samples = count;
+  out->children = count;
+}
+
+// Writes a finished entry to its level, and adds it to the entry being
+// built on the level above.
+static void emit(prudaq_pyramid_t *pyramid, int level,
+                 const accumulator_t *entry) {
+  FILE **file = &(pyramid->files[level - 1]);
+  if (!*file && !pyramid->failed) {
+    char fname[strlen(pyramid->prefix) + 4];
+    sprintf(fname, "%s.%d", pyramid->prefix, level);
+    *file = fopen(fname, "w");
+    if (!*file) {
+      perror("unable to open pyramid file");
+      pyramid->failed = 1;
+    }
+  }
+
+  prudaq_envelope_t envelope;
+  for (int c = 0; c < 2; c++) {
+    envelope.min[c] = entry->min[c];
+    envelope.max[c] = entry->max[c];
+    envelope.mean[c] = (entry->sum[c] * 64 + entry->samples / 2) /
+                       entry->samples;
+  }
+  if (*file && 1 != fwrite(&envelope, sizeof(envelope), 1, *file)) {
+    pyramid->failed = 1;
+  }
+  pyramid->entries[level - 1]++;
+
+  if (level == PRUDAQ_PYRAMID_MAX_LEVELS) return;
+  accumulator_t *above = &(pyramid->pending[level]);
+  merge(above, entry);
+  if (above->children == PRUDAQ_PYRAMID_FANOUT) {
+    emit(pyramid, level + 1, above);
+    reset(above);
+  }
+}
+
+prudaq_pyramid_t *prudaq_pyramid_create(const char *prefix) {
+  prudaq_pyramid_t *pyramid = (prudaq_pyramid_t *) calloc(1, sizeof(*pyramid));
+  if (!pyramid || !(pyramid->prefix = strdup(prefix))) {
+    fprintf(stderr, "Couldn't allocate memory.\n");
+    free(pyramid);
+    return NULL;
+  }
+  for (int level = 1; level <= PRUDAQ_PYRAMID_MAX_LEVELS; level++) {
+    reset(&(pyramid->pending[level - 1]));
+  }
+  return pyramid;
+}
+
+void prudaq_pyramid_add(prudaq_pyramid_t *pyramid, const uint32_t *words,
+                        uint32_t count) {
+  // pending[0] holds level 1's partial entry, left over from the last call
+  accumulator_t *partial = &(pyramid->pending[0]);
+  accumulator_t entry;
+  pyramid->samples += count;
+
+  // Finish off the entry the last call couldn't
+  if (partial->children > 0) {
+    int needed = PRUDAQ_PYRAMID_FANOUT - partial->children;
+    int n = count < (uint32_t) needed ? (int) count : needed;
+    summarize(words, n, &entry);
+    int children = partial->children + n;
+    merge(partial, &entry);
+    partial->children = children;
+    words += n;
+    count -= n;
+    if (children < PRUDAQ_PYRAMID_FANOUT) return;
+    emit(pyramid, 1, partial);
+    reset(partial);
+  }
+
+  for (; count >= PRUDAQ_PYRAMID_FANOUT; count -= PRUDAQ_PYRAMID_FANOUT) {
+    summarize(words, PRUDAQ_PYRAMID_FANOUT, &entry);
+    emit(pyramid, 1, &entry);
+    words += PRUDAQ_PYRAMID_FANOUT;
+  }
+
+  if (count > 0) {
+    summarize(words, count, partial);
+  }
+}
+
+int prudaq_pyramid_finish(prudaq_pyramid_t *pyramid) {
+  // Push each level's partial entry out, which may in turn complete or
+  // start the one above it.  Stop at the first level that only has one
+  // entry, since it covers everything.
+  int levels = 0;
+  for (int level = 1; level <= PRUDAQ_PYRAMID_MAX_LEVELS; level++) {
+    accumulator_t *partial = &(pyramid->pending[level - 1]);
+    if (partial->children > 0) {
+      accumulator_t entry = *partial;
+      reset(partial);
+      emit(pyramid, level, &entry);
+    }
+    if (pyramid->entries[level - 1] == 0) break;
+    levels = level;
+    if (pyramid->entries[level - 1] == 1) break;
+  }
+
+  for (int level = 1; level <= PRUDAQ_PYRAMID_MAX_LEVELS; level++) {
+    FILE *file = pyramid->files[level - 1];
+    if (file && 0 != fclose(file)) {
+      pyramid->failed = 1;
+    }
+  }
+
+  FILE *index = fopen(pyramid->prefix, "w");
+  if (!index) {
+    perror("unable to open pyramid index");
+    pyramid->failed = 1;
+  } else {
+    fprintf(index, "fanout %d\nsamples %" PRIu64 "\nlevels %d\n",
+            PRUDAQ_PYRAMID_FANOUT, pyramid->samples, levels);
+    if (0 != fclose(index)) {
+      pyramid->failed = 1;
+    }
+  }
+
+  int failed = pyramid->failed;
+  if (failed) {
+    fprintf(stderr, "Couldn't write all of pyramid %s\n", pyramid->prefix);
+  }
+  free(pyramid->prefix);
+  free(pyramid);
+  return failed ? -1 : 0;
+}
+
+prudaq_pyramid_reader_t *prudaq_pyramid_open(const char *prefix) {
+  prudaq_pyramid_reader_t *reader =
+      (prudaq_pyramid_reader_t *) calloc(1, sizeof(*reader));
+  if (!reader) {
+    fprintf(stderr, "Couldn't allocate memory.\n");
+    return NULL;
+  }
+  for (int level = 1; level <= PRUDAQ_PYRAMID_MAX_LEVELS; level++) {
+    reader->fds[level - 1] = -1;
+  }
+
+  FILE *index = fopen(prefix, "r");
+  if (!index) {
+    perror("unable to open pyramid index");
+    free(reader);
+    return NULL;
+  }
+  int fanout = 0;
+  int fields = fscanf(index, "fanout %d samples %" SCNu64 " levels %d",
+                      &fanout, &(reader->samples), &(reader->levels));
+  fclose(index);
+  if (fields != 3 || fanout != PRUDAQ_PYRAMID_FANOUT ||
+      reader->levels < 1 || reader->levels > PRUDAQ_PYRAMID_MAX_LEVELS) {
+    fprintf(stderr, "%s isn't a pyramid index, or has a different fanout\n",
+            prefix);
+    free(reader);
+    return NULL;
+  }
+
+  for (int level = 1; level <= reader->levels; level++) {
+    char fname[strlen(prefix) + 4];
+    sprintf(fname, "%s.%d", prefix, level);
+    reader->fds[level - 1] = open(fname, O_RDONLY);
+    if (reader->fds[level - 1] < 0) {
+      perror("unable to open pyramid file");
+      prudaq_pyramid_close(reader);
+      return NULL;
+    }
+  }
+  return reader;
+}
+
+void prudaq_pyramid_close(prudaq_pyramid_reader_t *reader) {
+  for (int level = 1; level <= PRUDAQ_PYRAMID_MAX_LEVELS; level++) {
+    if (reader->fds[level - 1] >= 0) {
+      close(reader->fds[level - 1]);
+    }
+  }
+  free(reader->entries);
+  free(reader);
+}
+
+uint64_t prudaq_pyramid_samples(const prudaq_pyramid_reader_t *reader) {
+  return reader->samples;
+}
+
+int prudaq_pyramid_render(prudaq_pyramid_reader_t *reader, uint64_t start,
+                          uint64_t end, prudaq_envelope_t *pixels, int width) {
+  if (end > reader->samples) end = reader->samples;
+  if (width < 1 || start >= end) {
+    fprintf(stderr, "Nothing to render\n");
+    return -1;
+  }
+
+  // Use the coarsest level whose entries still fit in a pixel
+  uint64_t samples_per_pixel = (end - start) / width;
+  int level = 1;
+  uint64_t span = PRUDAQ_PYRAMID_FANOUT;
+  while (level < reader->levels &&
+         span * PRUDAQ_PYRAMID_FANOUT <= samples_per_pixel) {
+    level++;
+    span *= PRUDAQ_PYRAMID_FANOUT;
+  }
+
+  // Read every entry touching [start, end) in one go
+  uint64_t first = start / span;
+  uint64_t last = (end - 1) / span;
+  uint64_t count = last - first + 1;
+  if (count > reader->entries_len) {
+    free(reader->entries);
+    reader->entries = (prudaq_envelope_t *) malloc(count * sizeof(*pixels));
+    if (!reader->entries) {
+      fprintf(stderr, "Couldn't allocate memory.\n");
+      reader->entries_len = 0;
+      return -1;
+    }
+    reader->entries_len = count;
+  }
+  size_t bytes = count * sizeof(*pixels);
+  if ((ssize_t) bytes != pread(reader->fds[level - 1], reader->entries, bytes,
+                               first * sizeof(*pixels))) {
+    fprintf(stderr, "Pyramid level %d is shorter than its index says\n",
+            level);
+    return -1;
+  }
+
+  for (int p = 0; p < width; p++) {
+    uint64_t from = start + (end - start) * p / width;
+    uint64_t to = start + (end - start) * (p + 1) / width;
+    if (to <= from) to = from + 1;
+
+    uint64_t weight = 0;
+    uint64_t sum[2] = { 0, 0 };
+    pixels[p].min[0] = pixels[p].min[1] = UINT16_MAX;
+    pixels[p].max[0] = pixels[p].max[1] = 0;
+    for (uint64_t e = from / span; e <= (to - 1) / span; e++) {
+      const prudaq_envelope_t *entry = &(reader->entries[e - first]);
+      // Weight the means by how many samples each entry covers, which is
+      // only less than span for the last entry of the capture
+      uint64_t samples = reader->samples - e * span < span ?
+                         reader->samples - e * span : span;
+      for (int c = 0; c < 2; c++) {
+        if (entry->min[c] < pixels[p].min[c]) pixels[p].min[c] = entry->min[c];
+        if (entry->max[c] > pixels[p].max[c]) pixels[p].max[c] = entry->max[c];
+        sum[c] += samples * entry->mean[c];
+      }
+      weight += samples;
+    }
+    for (int c = 0; c < 2; c++) {
+      pixels[p].mean[c] = (sum[c] + weight / 2) / weight;
+    }
+  }
+  return level;
+}
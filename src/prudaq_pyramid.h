@@ -0,0 +1,89 @@
+/*
+Copyright 2015 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied.  See the License for the specific language governing
+permissions and limitations under the License.
+*/
+
+/*
+Min/max/mean envelope pyramids, for viewing long captures without reading
+every sample.
+
+prudaq_capture -p prefix builds one while it captures.  Level 1 has one
+entry for every PRUDAQ_PYRAMID_FANOUT samples, level 2 has one for every
+PRUDAQ_PYRAMID_FANOUT level 1 entries, and so on until a level has a single
+entry covering the whole capture (or PRUDAQ_PYRAMID_MAX_LEVELS is reached).  Each level is an array of
+prudaq_envelope_t in its own file, prefix.1, prefix.2, ..., and prefix
+itself is a short text file recording the fanout, the number of samples and
+the number of levels.
+
+Drawing any stretch of the capture at any width only needs the level whose
+entries are just smaller than a pixel, so prudaq_pyramid_render() reads
+at most PRUDAQ_PYRAMID_FANOUT + 1 entries per pixel however long the
+capture is.
+*/
+
+#ifndef PRUDAQ_PYRAMID_H
+#define PRUDAQ_PYRAMID_H
+
+#include <inttypes.h>
+
+#define PRUDAQ_PYRAMID_FANOUT 16
+
+// Most levels a pyramid gets.  Each level 12 entry covers 16^12 samples,
+// about 260 days at 12.5MHz.  Longer captures still work, but level 12
+// keeps growing past one entry.  Rendering more than that at once can
+// then read more than PRUDAQ_PYRAMID_FANOUT + 1 entries per pixel.
+#define PRUDAQ_PYRAMID_MAX_LEVELS 12
+
+// Summary of a run of samples.  Index 0 is channel 0 and index 1 is
+// channel 1.
+typedef struct {
+  uint16_t min[2];
+  uint16_t max[2];
+  // In 64ths of a code, which fits a 10-bit mean with room to spare
+  uint16_t mean[2];
+} prudaq_envelope_t;
+
+typedef struct prudaq_pyramid prudaq_pyramid_t;
+typedef struct prudaq_pyramid_reader prudaq_pyramid_reader_t;
+
+// Starts a new pyramid at prefix.  Returns NULL (after explaining why on
+// stderr) on failure.
+prudaq_pyramid_t *prudaq_pyramid_create(const char *prefix);
+
+// Adds count raw sample words (as handed out by prudaq_acquire()) to the
+// pyramid.  Only the 10 data bits of each channel are used.
+void prudaq_pyramid_add(prudaq_pyramid_t *pyramid, const uint32_t *words,
+                        uint32_t count);
+
+// Writes out the partial entries at the end of each level, finishes the
+// files and frees the pyramid.  Returns -1 if anything couldn't be written.
+int prudaq_pyramid_finish(prudaq_pyramid_t *pyramid);
+
+// Opens a finished pyramid for reading.  Returns NULL (after explaining why
+// on stderr) on failure.
+prudaq_pyramid_reader_t *prudaq_pyramid_open(const char *prefix);
+
+void prudaq_pyramid_close(prudaq_pyramid_reader_t *reader);
+
+// Number of samples the pyramid covers
+uint64_t prudaq_pyramid_samples(const prudaq_pyramid_reader_t *reader);
+
+// Fills in pixels[0..width-1] with the envelope of samples [start, end),
+// split evenly among the pixels.  Pixels narrower than a level 1 entry
+// get the envelope of the entry they fall in.  Returns the level that was
+// read, or -1 on failure.
+int prudaq_pyramid_render(prudaq_pyramid_reader_t *reader, uint64_t start,
+                          uint64_t end, prudaq_envelope_t *pixels, int width);
+
+#endif
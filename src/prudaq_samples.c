@@ -0,0 +1,100 @@
+/*
+Copyright 2015 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied.  See the License for the specific language governing
+permissions and limitations under the License.
+*/
+
+/*
+Parts of libprudaq that don't need the PRUs: clock and input select math,
+and the kernels for turning raw sample words into sample data.
+*/
+
+#include <stdlib.h>
+
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
+#include "prudaq.h"
+#include "shared_header.h"
+
+int prudaq_clock_cycles(double freq, uint32_t *high_cycles,
+                        uint32_t *low_cycles) {
+  if (freq <= 0) return -1;
+
+  // Adding 0.5 and truncating is equivalent to rounding
+  double cycles = PRUDAQ_PRU_CLK/freq + 0.5;
+  if (cycles > UINT32_MAX) return -1;
+
+  // PRU0 polls the control channel during the high half, so when the period
+  // is too short to split evenly, give the high half the extra cycles.
+  uint32_t high = (uint32_t) cycles / 2;
+  if (high < 6 + CTRL_POLL_CYCLES) {
+    high = 6 + CTRL_POLL_CYCLES;
+  }
+  if ((uint32_t) cycles < high + 6) return -1;
+
+  *high_cycles = high;
+  *low_cycles = (uint32_t) cycles - high;
+  return 0;
+}
+
+int32_t prudaq_input_select(int channel0_input, int channel1_input) {
+  // See the docs for how bits in r30 correspond to the INPUT0A/
+  // INPUT0B/INPUT1A/INPUT1B control lines on the analog switches.
+  uint32_t pru0r30 = 0;
+  switch (channel0_input) {
+    case 0: break;
+    case 1: pru0r30 |= (1 << 1); break;
+    case 2: pru0r30 |= (1 << 2); break;
+    case 3: pru0r30 |= (1 << 1) | (1 << 2); break;
+    default: return -1;
+  }
+  switch (channel1_input) {
+    case 4: break;
+    case 5: pru0r30 |= (1 << 3); break;
+    case 6: pru0r30 |= (1 << 5); break;
+    case 7: pru0r30 |= (1 << 3) | (1 << 5); break;
+    default: return -1;
+  }
+  return pru0r30;
+}
+
+void prudaq_mask(uint32_t *words, uint32_t count) {
+  // Each 32-bit word holds a pair of samples, one from each channel.
+  // Samples are 10 bits, and the remaining bits record the clock and
+  // input select state.  (See doc/InputOutput.md for details)
+  for (uint32_t i = 0; i < count; i++) {
+    // Keep just the lower 10 bits from each 16-bit half of the 32-bit word
+    words[i] &= PRUDAQ_SAMPLE_MASK;
+  }
+}
+
+void prudaq_demux(const uint32_t *words, uint16_t *channel0,
+                  uint16_t *channel1, uint32_t count) {
+  uint32_t i = 0;
+#ifdef __ARM_NEON__
+  // vld2 splits alternating 16-bit halves into separate registers, so
+  // each pass demuxes 8 words with one load and two ANDs.
+  const uint16x8_t mask = vdupq_n_u16(0x03ff);
+  for (; i + 8 <= count; i += 8) {
+    uint16x8x2_t halves = vld2q_u16((const uint16_t *) &(words[i]));
+    if (channel0) vst1q_u16(&(channel0[i]), vandq_u16(halves.val[0], mask));
+    if (channel1) vst1q_u16(&(channel1[i]), vandq_u16(halves.val[1], mask));
+  }
+#endif
+  for (; i < count; i++) {
+    if (channel0) channel0[i] = words[i] & 0x03ff;
+    if (channel1) channel1[i] = (words[i] >> 16) & 0x03ff;
+  }
+}
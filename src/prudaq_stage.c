@@ -0,0 +1,195 @@
+/*
+Copyright 2015 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied.  See the License for the specific language governing
+permissions and limitations under the License.
+*/
+
+/*
+Runs chains of stages.  See prudaq_stage.h.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <dlfcn.h>
+
+#include "prudaq_stage.h"
+
+typedef struct {
+  const prudaq_stage_t *stage;
+  void *state;
+  // From dlopen(), or NULL for stages linked in directly
+  void *handle;
+  // What the stage has been asked to do, and how long it took
+  uint64_t batches;
+  uint64_t words_in;
+  uint64_t words_out;
+  uint64_t ns;
+} link_t;
+
+struct prudaq_chain {
+  link_t links[PRUDAQ_CHAIN_MAX_STAGES];
+  int length;
+  struct timespec created;
+};
+
+static uint64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+prudaq_chain_t *prudaq_chain_create(void) {
+  prudaq_chain_t *chain = (prudaq_chain_t *) calloc(1, sizeof(*chain));
+  if (!chain) {
+    fprintf(stderr, "Couldn't allocate memory.\n");
+    return NULL;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &(chain->created));
+  return chain;
+}
+
+int prudaq_chain_add(prudaq_chain_t *chain, const prudaq_stage_t *stage,
+                     const char *args) {
+  if (chain->length == PRUDAQ_CHAIN_MAX_STAGES) {
+    fprintf(stderr, "Too many stages (max: %d)\n", PRUDAQ_CHAIN_MAX_STAGES);
+    return -1;
+  }
+  if (stage->abi != PRUDAQ_STAGE_ABI) {
+    fprintf(stderr, "Stage %s was built for stage ABI %d, not %d\n",
+            stage->name, stage->abi, PRUDAQ_STAGE_ABI);
+    return -1;
+  }
+
+  link_t *link = &(chain->links[chain->length]);
+  memset(link, 0, sizeof(*link));
+  link->stage = stage;
+  if (stage->init && 0 != stage->init(args ? args : "", &(link->state))) {
+    fprintf(stderr, "Couldn't initialize stage %s\n", stage->name);
+    return -1;
+  }
+  chain->length++;
+  return 0;
+}
+
+int prudaq_chain_load(prudaq_chain_t *chain, const char *spec) {
+  char path[strlen(spec) + 1];
+  strcpy(path, spec);
+  char *args = strchr(path, ':');
+  if (args) {
+    *args++ = '\0';
+  }
+
+  // dlopen() only searches the library path for bare names
+  char *resolved = path;
+  char local[strlen(path) + 3];
+  if (!strchr(path, '/')) {
+    sprintf(local, "./%s", path);
+    resolved = local;
+  }
+
+  void *handle = dlopen(resolved, RTLD_NOW | RTLD_LOCAL);
+  if (!handle) {
+    fprintf(stderr, "Couldn't load stage: %s\n", dlerror());
+    return -1;
+  }
+  const prudaq_stage_t *stage =
+      (const prudaq_stage_t *) dlsym(handle, "prudaq_stage");
+  if (!stage) {
+    fprintf(stderr, "%s doesn't export prudaq_stage\n", path);
+    dlclose(handle);
+    return -1;
+  }
+  if (0 != prudaq_chain_add(chain, stage, args)) {
+    dlclose(handle);
+    return -1;
+  }
+  chain->links[chain->length - 1].handle = handle;
+  return 0;
+}
+
+// Runs batch through the stages from first on
+static int run(prudaq_chain_t *chain, int first, prudaq_span_t batch) {
+  for (int i = first; i < chain->length && batch.count > 0; i++) {
+    link_t *link = &(chain->links[i]);
+    link->batches++;
+    link->words_in += batch.count;
+    uint64_t start = now_ns();
+    int result = link->stage->process_batch(link->state, &batch);
+    link->ns += now_ns() - start;
+    if (0 != result) {
+      fprintf(stderr, "Stage %s failed\n", link->stage->name);
+      return -1;
+    }
+    link->words_out += batch.count;
+  }
+  return 0;
+}
+
+int prudaq_chain_process(prudaq_chain_t *chain, const uint32_t *words,
+                         uint32_t count) {
+  prudaq_span_t batch = { words, count };
+  return run(chain, 0, batch);
+}
+
+int prudaq_chain_flush(prudaq_chain_t *chain) {
+  for (int i = 0; i < chain->length; i++) {
+    link_t *link = &(chain->links[i]);
+    if (!link->stage->flush) continue;
+
+    prudaq_span_t batch = { NULL, 0 };
+    uint64_t start = now_ns();
+    int result = link->stage->flush(link->state, &batch);
+    link->ns += now_ns() - start;
+    if (0 != result) {
+      fprintf(stderr, "Stage %s failed to flush\n", link->stage->name);
+      return -1;
+    }
+    link->words_out += batch.count;
+    if (0 != run(chain, i + 1, batch)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void prudaq_chain_report(const prudaq_chain_t *chain, FILE *out) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double wall = (now.tv_sec - chain->created.tv_sec) +
+                (now.tv_nsec - chain->created.tv_nsec) / 1e9;
+
+  for (int i = 0; i < chain->length; i++) {
+    const link_t *link = &(chain->links[i]);
+    fprintf(out, "Stage %d (%s): %" PRIu64 " batches, %" PRIu64 " words in,"
+            " %" PRIu64 " out, %.3fs (%.1fns/word, %.1f%% of the run)\n",
+            i, link->stage->name, link->batches, link->words_in,
+            link->words_out, link->ns / 1e9,
+            link->words_in ? (double) link->ns / link->words_in : 0,
+            wall > 0 ? link->ns / 1e9 / wall * 100 : 0);
+  }
+}
+
+void prudaq_chain_destroy(prudaq_chain_t *chain) {
+  for (int i = 0; i < chain->length; i++) {
+    link_t *link = &(chain->links[i]);
+    if (link->stage->fini) {
+      link->stage->fini(link->state);
+    }
+    if (link->handle) {
+      dlclose(link->handle);
+    }
+  }
+  free(chain);
+}
@@ -0,0 +1,114 @@
+/*
+Copyright 2015 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied.  See the License for the specific language governing
+permissions and limitations under the License.
+*/
+
+/*
+Processing stages for the host side drain loops.
+
+A stage is a shared object exporting a prudaq_stage_t named prudaq_stage:
+
+  static int init(const char *args, void **state) { ... }
+  static int process_batch(void *state, prudaq_span_t *batch) { ... }
+  static int flush(void *state, prudaq_span_t *batch) { ... }
+  const prudaq_stage_t prudaq_stage = {
+    PRUDAQ_STAGE_ABI, "example", init, process_batch, flush, NULL
+  };
+
+built with something like:
+
+  gcc -shared -fPIC -I/path/to/prudaq/src -o example.so example.c
+
+Stages are chained: each one gets the batch the one before it passed on,
+so a stage can either look at its input and pass it along untouched, or
+hand the rest of the chain its own output instead (decimated, filtered,
+mixed down, ...).  Batches are 32-bit words.  What comes from the drain
+loop is as described for prudaq_span_t, or for round-robin, 8-byte records
+of amplitudes, always in normal memory and as large as the drain loop can
+make them.
+
+prudaq_capture and round-robin load stages given with -s, and report how
+much time each one took when they exit, so that expensive stages are easy
+to spot before they make the drain loop fall behind.
+*/
+
+#ifndef PRUDAQ_STAGE_H
+#define PRUDAQ_STAGE_H
+
+#include <stdio.h>
+
+#include "prudaq.h"
+
+// Bumped whenever prudaq_stage_t changes
+#define PRUDAQ_STAGE_ABI 1
+
+#define PRUDAQ_CHAIN_MAX_STAGES 16
+
+typedef struct {
+  // PRUDAQ_STAGE_ABI, so that stages built against a different version are
+  // turned away rather than crashing
+  int abi;
+  const char *name;
+
+  // Sets up *state.  args is whatever followed the ':' in the stage spec,
+  // or "" if nothing did.  Returns -1 (after explaining why on stderr) on
+  // failure.
+  int (*init)(const char *args, void **state);
+
+  // Processes a batch.  The words are read-only.  To pass something else
+  // on to the rest of the chain, point batch at it (it needs to stay valid
+  // until the stage is called again), or set batch->count to 0 to pass
+  // nothing on.  Returns -1 (after explaining why on stderr) to stop.
+  int (*process_batch)(void *state, prudaq_span_t *batch);
+
+  // Called once after the last batch, with an empty batch that the stage
+  // can fill in with anything it's been holding on to.  Returns -1 on
+  // failure.  May be NULL.
+  int (*flush)(void *state, prudaq_span_t *batch);
+
+  // Frees state, once the rest of the chain is done with whatever flush()
+  // passed on.  May be NULL.
+  void (*fini)(void *state);
+} prudaq_stage_t;
+
+typedef struct prudaq_chain prudaq_chain_t;
+
+// Returns an empty chain, or NULL if out of memory.
+prudaq_chain_t *prudaq_chain_create(void);
+
+// Appends a stage to the chain, and initializes it with args.  Returns -1
+// (after explaining why on stderr) on failure.
+int prudaq_chain_add(prudaq_chain_t *chain, const prudaq_stage_t *stage,
+                     const char *args);
+
+// Loads a stage from a shared object and appends it.  spec is the path to
+// the .so, optionally followed by ':' and the arguments for its init().
+// Returns -1 (after explaining why on stderr) on failure.
+int prudaq_chain_load(prudaq_chain_t *chain, const char *spec);
+
+// Runs a batch through every stage.  Returns -1 if a stage failed.
+int prudaq_chain_process(prudaq_chain_t *chain, const uint32_t *words,
+                         uint32_t count);
+
+// Flushes each stage in turn, running whatever it hands on through the
+// stages after it.  Returns -1 if a stage failed.
+int prudaq_chain_flush(prudaq_chain_t *chain);
+
+// Writes each stage's batch and word counts, and the time it took, to out.
+void prudaq_chain_report(const prudaq_chain_t *chain, FILE *out);
+
+// Frees every stage, and the chain.
+void prudaq_chain_destroy(prudaq_chain_t *chain);
+
+#endif